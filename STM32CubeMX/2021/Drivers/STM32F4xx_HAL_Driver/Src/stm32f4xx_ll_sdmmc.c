@@ -879,6 +879,31 @@ uint32_t SDMMC_CmdAppCommand(SDIO_TypeDef *SDIOx, uint32_t Argument)
   return errorstate;
 }
 
+/**
+  * @brief  MM: Send the Set Write Block Erase Count command (ACMD23) and check
+  *         the response. Must follow SDMMC_CmdAppCommand.
+  * @param  SDIOx: Pointer to SDIO register base
+  * @param  BlockCount: Number of blocks to pre-erase
+  * @retval HAL status
+  */
+uint32_t SDMMC_CmdSetWrBlkEraseCount(SDIO_TypeDef *SDIOx, uint32_t BlockCount)
+{
+  SDIO_CmdInitTypeDef  sdmmc_cmdinit;
+  uint32_t errorstate;
+
+  sdmmc_cmdinit.Argument         = BlockCount & 0x007FFFFFU;
+  sdmmc_cmdinit.CmdIndex         = SDMMC_CMD_SD_APP_SET_WR_BLK_ERASE_COUNT;
+  sdmmc_cmdinit.Response         = SDIO_RESPONSE_SHORT;
+  sdmmc_cmdinit.WaitForInterrupt = SDIO_WAIT_NO;
+  sdmmc_cmdinit.CPSM             = SDIO_CPSM_ENABLE;
+  (void)SDIO_SendCommand(SDIOx, &sdmmc_cmdinit);
+
+  /* Check for error conditions */
+  errorstate = SDMMC_GetCmdResp1(SDIOx, SDMMC_CMD_SD_APP_SET_WR_BLK_ERASE_COUNT, SDIO_CMDTIMEOUT);
+
+  return errorstate;
+}
+
 /**
   * @brief  Send the command asking the accessed card to send its operating 
   *         condition register (OCR)
@@ -139,7 +139,11 @@ typedef struct __attribute__((packed))
 
 	uint8_t scsiSpeed;
 
-	uint8_t reserved[119]; // Pad out to 128 bytes
+	// Sequential writes of up to this many SD sectors are held in the
+	// write cache and written to the SD card together. 0 = disabled.
+	uint8_t writeCoalesce;
+
+	uint8_t reserved[118]; // Pad out to 128 bytes
 } S2S_BoardCfg;
 
 typedef enum
@@ -215,8 +219,55 @@ typedef enum
 	// uint8_t S2S_CFG_DEBUG
 	// Response:
 	S2S_CMD_DEBUG,
+
+	// Command content:
+	// uint8_t S2S_CMD_TRACE
+	// uint32_t Number of the first trace record wanted (MSB)
+	// Response:
+	// uint32_t Number of the next record to be written (MSB)
+	// uint32_t CPU cycles per second (MSB)
+	// uint8_t Record count. Up to S2S_TRACE_MAX_RECORDS.
+	// S2S_TRACE_RECORD_LEN bytes per record, oldest first:
+	//   uint32_t Record number (MSB)
+	//   uint8_t Initiator ID
+	//   uint8_t Target ID
+	//   uint8_t Status. 0xFF if no status was sent.
+	//   uint8_t CDB length
+	//   uint8_t[16] CDB
+	//   uint32_t Cycle counter at selection (MSB)
+	//   uint32_t Cycle counter after the command phase (MSB)
+	//   uint32_t Cycle counter at the first data phase, or 0 (MSB)
+	//   uint32_t Cycle counter at the status phase, or 0 (MSB)
+	//   uint32_t Cycle counter at bus free (MSB)
+	//   uint32_t Bytes transferred in data phases (MSB)
+	//   uint32_t Cycles taken by the first SD card request, or 0 (MSB)
+	// Records that were overwritten before being read are skipped.
+	S2S_CMD_TRACE,
+
+	// Command content:
+	// uint8_t S2S_CMD_STATS
+	// uint8_t SCSI ID
+	// Response:
+	// uint32_t CPU cycles per second (MSB)
+	// uint64_t Bytes sent to the initiator (MSB)
+	// uint64_t Bytes received from the initiator (MSB)
+	// uint64_t Cycles from selection to bus free, for all commands (MSB)
+	// uint64_t Cycles the SD card was busy during commands (MSB)
+	// uint32_t[4][S2S_STATS_BUCKETS] Command latency histograms (MSB), for
+	//   read, write, inquiry/mode and other commands.
+	//   Bucket 0 counts commands taking < 1us. Bucket n counts commands
+	//   taking 2^(n-1)us up to 2^n us. The last bucket also counts anything
+	//   longer.
+	// All values are totals since power on.
+	S2S_CMD_STATS,
 } S2S_COMMAND;
 
+#define S2S_TRACE_RECORD_LEN 52
+#define S2S_TRACE_MAX_RECORDS 9
+
+#define S2S_STATS_BUCKETS 20
+#define S2S_STATS_LEN (36 + 4 * S2S_STATS_BUCKETS * 4)
+
 typedef enum
 {
 	S2S_CFG_STATUS_GOOD,
@@ -18,9 +18,35 @@
 #include "bsp.h"
 
 
+// Measured SD card write speed. 0 until the first sample.
+static uint32_t sdRateKBs = 0;
+
 uint32_t s2s_getSdRateKBs()
 {
-	return 12000; // ((48MHz / 2) / 8bits) * 4bitparallel
+	if (sdRateKBs == 0)
+	{
+		return 12000; // ((48MHz / 2) / 8bits) * 4bitparallel
+	}
+	return sdRateKBs;
+}
+
+void s2s_addSdRateSample(uint32_t rateKBs)
+{
+	// Drop quickly, rise slowly. Over-estimating the card speed causes
+	// blind write underruns.
+	if ((sdRateKBs == 0) || (rateKBs < sdRateKBs))
+	{
+		sdRateKBs = rateKBs;
+	}
+	else
+	{
+		sdRateKBs = (sdRateKBs * 3 + rateKBs) / 4;
+	}
+}
+
+void s2s_resetSdRate()
+{
+	sdRateKBs = 0;
 }
 
 
@@ -25,6 +25,8 @@
 #define S2S_DMA_ALIGN __attribute__((aligned(1024)))
 
 uint32_t s2s_getSdRateKBs();
+void s2s_addSdRateSample(uint32_t rateKBs);
+void s2s_resetSdRate();
 
 #endif
 
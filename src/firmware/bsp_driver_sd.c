@@ -205,22 +205,22 @@ uint8_t BSP_SD_WriteBlocks_DMA(uint8_t *pData, uint64_t BlockAddr, uint32_t NumO
 }
 
 /**
-  * @brief  Erases the specified memory area of the given SD card. 
-  * @param  StartAddr: Start byte address
-  * @param  EndAddr: End byte address
+  * @brief  Erases the specified memory area of the given SD card.
+  *         Returns once the card accepts the command. The card is busy until
+  *         HAL_SD_GetCardState() is no longer HAL_SD_CARD_PROGRAMMING.
+  * @param  StartBlock: First SD block to erase
+  * @param  EndBlock: Last SD block to erase (inclusive)
   * @retval SD status
   */
-/*
-uint8_t BSP_SD_Erase(uint64_t StartAddr, uint64_t EndAddr)
+uint8_t BSP_SD_Erase(uint32_t StartBlock, uint32_t EndBlock)
 {
-  if(HAL_SD_Erase(&hsd, StartAddr, EndAddr) != SD_OK)  
+  if(HAL_SD_Erase(&hsd, StartBlock, EndBlock) != HAL_OK)
   {
     return MSD_ERROR;
   }
 
   return MSD_OK;
 }
-*/
 
 /**
   * @brief  Handles SD card interrupt request.
@@ -92,7 +92,7 @@ uint8_t BSP_SD_ReadBlocks(uint8_t *pData, uint64_t BlockAddr, uint32_t NumOfBloc
 uint8_t BSP_SD_WriteBlocks(uint8_t *pData, uint64_t BlockAddr, uint32_t NumOfBlocks);
 uint8_t BSP_SD_ReadBlocks_DMA(uint8_t *pData, uint64_t BlockAddr, uint32_t NumOfBlocks);
 uint8_t BSP_SD_WriteBlocks_DMA(uint8_t *pData, uint64_t BlockAddr, uint32_t NumOfBlocks);
-//uint8_t BSP_SD_Erase(uint64_t StartAddr, uint64_t EndAddr);
+uint8_t BSP_SD_Erase(uint32_t StartBlock, uint32_t EndBlock);
 //void BSP_SD_IRQHandler(void);
 //void BSP_SD_DMA_Tx_IRQHandler(void);
 //void BSP_SD_DMA_Rx_IRQHandler(void);
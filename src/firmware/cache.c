@@ -0,0 +1,349 @@
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "cache.h"
+#include "bsp.h"
+#include "sd.h"
+
+#include <string.h>
+
+// Simple fully-associative LRU cache of SD sectors.
+// The cache is small enough that a linear search is faster than
+// maintaining any sort of index.
+
+typedef struct
+{
+	uint32_t sdLBA;
+	uint32_t lastUse;
+	int valid;
+	int locked;
+	int dirty; // Newer than the data on the SD card
+} CacheEntry;
+
+S2S_CacheStats s2s_cacheStats;
+
+static CacheEntry entries[S2S_CACHE_SECTORS];
+static uint8_t cacheData[S2S_CACHE_SECTORS][SD_SECTOR_SIZE] S2S_DMA_ALIGN;
+static uint32_t useCounter;
+static int allocated = -1; // Entry returned by s2s_cacheAllocate
+
+static int inRange(const CacheEntry* entry, uint32_t sdLBA, uint32_t sectors)
+{
+	return (entry->sdLBA >= sdLBA) && (entry->sdLBA - sdLBA < sectors);
+}
+
+static int findEntry(uint32_t sdLBA)
+{
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (entries[i].valid && (entries[i].sdLBA == sdLBA))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int isWritable(int i)
+{
+	return !entries[i].dirty && !entries[i].locked && (i != allocated);
+}
+
+// Choose an entry for newly written data. Sequential sectors go in adjacent
+// entries so they can be written back in one transaction.
+static int findWriteEntry(uint32_t sdLBA)
+{
+	int prev = findEntry(sdLBA - 1);
+	if ((prev >= 0) &&
+		entries[prev].dirty &&
+		(prev + 1 < S2S_CACHE_SECTORS) &&
+		isWritable(prev + 1))
+	{
+		return prev + 1;
+	}
+
+	// Start a new run at the longest stretch of writable entries.
+	int best = -1;
+	int bestLen = 0;
+	int i = 0;
+	while (i < S2S_CACHE_SECTORS)
+	{
+		int len = 0;
+		while ((i + len < S2S_CACHE_SECTORS) && isWritable(i + len))
+		{
+			++len;
+		}
+
+		if (len > bestLen)
+		{
+			best = i;
+			bestLen = len;
+		}
+		i += len + 1;
+	}
+	return best;
+}
+
+void s2s_cacheInit()
+{
+	s2s_cacheInvalidateAll();
+	s2s_cacheStats.hits = 0;
+	s2s_cacheStats.misses = 0;
+}
+
+int s2s_cacheContains(uint32_t sdLBA, uint32_t sectors)
+{
+	if (sectors > S2S_CACHE_SECTORS)
+	{
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < sectors; ++i)
+	{
+		if (findEntry(sdLBA + i) < 0)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+const uint8_t* s2s_cacheLookup(uint32_t sdLBA)
+{
+	int i = findEntry(sdLBA);
+	if (i < 0)
+	{
+		return NULL;
+	}
+
+	entries[i].lastUse = ++useCounter;
+	return cacheData[i];
+}
+
+uint8_t* s2s_cacheAllocate(uint32_t sdLBA)
+{
+	int victim = findEntry(sdLBA);
+	if ((victim >= 0) && entries[victim].dirty)
+	{
+		// Don't replace newer data with whatever is on the SD card.
+		return NULL;
+	}
+
+	for (int i = 0; (victim < 0) && (i < S2S_CACHE_SECTORS); ++i)
+	{
+		if (!entries[i].valid)
+		{
+			victim = i;
+			entries[i].locked = 0;
+		}
+	}
+
+	if (victim < 0)
+	{
+		// Evict the least recently used unlocked entry. Compare ages rather
+		// than raw counters so wrap-around doesn't matter.
+		for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+		{
+			if (!entries[i].locked &&
+				!entries[i].dirty &&
+				((victim < 0) ||
+					((useCounter - entries[i].lastUse) >
+						(useCounter - entries[victim].lastUse))))
+			{
+				victim = i;
+			}
+		}
+	}
+
+	if (victim < 0)
+	{
+		return NULL;
+	}
+
+	entries[victim].sdLBA = sdLBA;
+	entries[victim].valid = 0;
+	allocated = victim;
+	return cacheData[victim];
+}
+
+void s2s_cacheCommit(uint32_t sdLBA)
+{
+	if ((allocated >= 0) && (entries[allocated].sdLBA == sdLBA))
+	{
+		entries[allocated].lastUse = ++useCounter;
+		entries[allocated].valid = 1;
+	}
+	allocated = -1;
+}
+
+void s2s_cacheInsert(uint32_t sdLBA, const uint8_t* data)
+{
+	uint8_t* buf = s2s_cacheAllocate(sdLBA);
+	if (buf)
+	{
+		memcpy(buf, data, SD_SECTOR_SIZE);
+		s2s_cacheCommit(sdLBA);
+	}
+}
+
+int s2s_cacheCanLock(uint32_t sdLBA, uint32_t sectors)
+{
+	uint32_t lockedElsewhere = 0;
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (entries[i].locked && !inRange(&entries[i], sdLBA, sectors))
+		{
+			++lockedElsewhere;
+		}
+	}
+	return (sectors <= S2S_CACHE_SECTORS) &&
+		(sectors + lockedElsewhere <= S2S_CACHE_SECTORS);
+}
+
+void s2s_cacheSetLocked(uint32_t sdLBA, uint32_t sectors, int locked)
+{
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (entries[i].valid && inRange(&entries[i], sdLBA, sectors))
+		{
+			entries[i].locked = locked;
+		}
+	}
+}
+
+int s2s_cacheIsLocked(uint32_t sdLBA)
+{
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (entries[i].valid && entries[i].locked && (entries[i].sdLBA == sdLBA))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uint32_t s2s_cacheUnlockedSectors()
+{
+	uint32_t result = 0;
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (!entries[i].locked)
+		{
+			++result;
+		}
+	}
+	return result;
+}
+
+void s2s_cacheInvalidate(uint32_t sdLBA, uint32_t sectors)
+{
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (inRange(&entries[i], sdLBA, sectors))
+		{
+			entries[i].valid = 0;
+			entries[i].locked = 0;
+			entries[i].dirty = 0;
+			if (i == allocated)
+			{
+				allocated = -1;
+			}
+		}
+	}
+}
+
+void s2s_cacheInvalidateAll()
+{
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		entries[i].valid = 0;
+		entries[i].locked = 0;
+		entries[i].dirty = 0;
+	}
+	allocated = -1;
+}
+
+int s2s_cacheWrite(uint32_t sdLBA, const uint8_t* data)
+{
+	int i = findEntry(sdLBA);
+	if (i < 0)
+	{
+		i = findWriteEntry(sdLBA);
+		if (i < 0)
+		{
+			return 0;
+		}
+		entries[i].sdLBA = sdLBA;
+	}
+
+	memcpy(cacheData[i], data, SD_SECTOR_SIZE);
+	entries[i].lastUse = ++useCounter;
+	entries[i].valid = 1;
+	entries[i].dirty = 1;
+	return 1;
+}
+
+const uint8_t* s2s_cacheNextDirty(uint32_t* sdLBA, uint32_t* sectors)
+{
+	int next = -1;
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (entries[i].dirty &&
+			((next < 0) || (entries[i].sdLBA < entries[next].sdLBA)))
+		{
+			next = i;
+		}
+	}
+
+	if (next < 0)
+	{
+		return NULL;
+	}
+
+	*sdLBA = entries[next].sdLBA;
+	*sectors = 1;
+	while ((next + *sectors < S2S_CACHE_SECTORS) &&
+		entries[next + *sectors].dirty &&
+		(entries[next + *sectors].sdLBA == *sdLBA + *sectors))
+	{
+		++*sectors;
+	}
+	return cacheData[next];
+}
+
+void s2s_cacheClean(uint32_t sdLBA, uint32_t sectors)
+{
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (entries[i].valid && inRange(&entries[i], sdLBA, sectors))
+		{
+			entries[i].dirty = 0;
+		}
+	}
+}
+
+int s2s_cacheIsDirty(uint32_t sdLBA, uint32_t sectors)
+{
+	for (int i = 0; i < S2S_CACHE_SECTORS; ++i)
+	{
+		if (entries[i].dirty && inRange(&entries[i], sdLBA, sectors))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
@@ -0,0 +1,85 @@
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef S2S_CACHE_H
+#define S2S_CACHE_H
+
+#include <stdint.h>
+
+// Number of 512-byte SD sectors held in the read cache.
+#define S2S_CACHE_SECTORS 16
+
+// Only reads of this many SD sectors or less are added to the cache.
+// Larger reads are most likely sequential scans that would otherwise
+// evict the frequently used directory/inode/FAT sectors.
+#define S2S_CACHE_MAX_INSERT 8
+
+typedef struct
+{
+	uint32_t hits; // READ commands served entirely from the cache
+	uint32_t misses; // READ commands that needed the SD card
+} S2S_CacheStats;
+
+extern S2S_CacheStats s2s_cacheStats;
+
+void s2s_cacheInit(void);
+
+// Returns non-zero if every sector in the range is in the cache.
+int s2s_cacheContains(uint32_t sdLBA, uint32_t sectors);
+
+// Returns the cached copy of the sector, or NULL. Marks the sector as
+// recently used.
+const uint8_t* s2s_cacheLookup(uint32_t sdLBA);
+
+void s2s_cacheInsert(uint32_t sdLBA, const uint8_t* data);
+
+// Reserve an entry for the sector, evicting an unlocked entry if required.
+// The returned buffer is suitable for DMA. The entry is not valid until
+// s2s_cacheCommit is called. Returns NULL if all entries are locked.
+uint8_t* s2s_cacheAllocate(uint32_t sdLBA);
+void s2s_cacheCommit(uint32_t sdLBA);
+
+// Locked entries are never evicted.
+// Returns non-zero if the range could be locked without exceeding the
+// cache size.
+int s2s_cacheCanLock(uint32_t sdLBA, uint32_t sectors);
+void s2s_cacheSetLocked(uint32_t sdLBA, uint32_t sectors, int locked);
+int s2s_cacheIsLocked(uint32_t sdLBA);
+
+// Number of entries available for new data.
+uint32_t s2s_cacheUnlockedSectors(void);
+
+// Must be called before any write to the SD card. Dirty entries in the
+// range are discarded.
+void s2s_cacheInvalidate(uint32_t sdLBA, uint32_t sectors);
+void s2s_cacheInvalidateAll(void);
+
+// Write-back support. Dirty entries hold data that hasn't been written to
+// the SD card yet, and are never evicted.
+// Returns 0 if there is no clean, unlocked entry available.
+int s2s_cacheWrite(uint32_t sdLBA, const uint8_t* data);
+
+// Sequential sectors are stored in adjacent entries where possible.
+// Returns the dirty sector with the lowest address, or NULL if there are no
+// dirty sectors. sectors is set to the number of dirty sectors that follow
+// it in both address and memory, so they can be written in a single SD
+// transaction. The data must not be modified until s2s_cacheClean is
+// called.
+const uint8_t* s2s_cacheNextDirty(uint32_t* sdLBA, uint32_t* sectors);
+void s2s_cacheClean(uint32_t sdLBA, uint32_t sectors);
+
+// Returns non-zero if any sector in the range is dirty.
+int s2s_cacheIsDirty(uint32_t sdLBA, uint32_t sectors);
+
+#endif
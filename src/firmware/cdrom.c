@@ -153,8 +153,8 @@ static void doReadTOC(int MSF, uint8_t track, uint16_t allocationLength)
 	if (track > 1)
 	{
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		scsiDev.phase = STATUS;
 	}
 	else
@@ -214,8 +214,8 @@ static void doReadFullTOC(int convertBCD, uint8_t session, uint16_t allocationLe
 	if (session > 1)
 	{
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		scsiDev.phase = STATUS;
 	}
 	else
@@ -298,8 +298,8 @@ int scsiCDRomCommand()
 			default:
 			{
 				scsiDev.status = CHECK_CONDITION;
-				scsiDev.target->sense.code = ILLEGAL_REQUEST;
-				scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+				scsiDev.target->sense->code = ILLEGAL_REQUEST;
+				scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 				scsiDev.phase = STATUS;
 			}
 		}
@@ -22,8 +22,11 @@
 #include "scsiPhy.h"
 #include "sd.h"
 #include "disk.h"
+#include "cache.h"
 #include "bootloader.h"
 #include "spinlock.h"
+#include "time.h"
+#include "trace.h"
 
 #include "../../include/scsi2sd.h"
 #include "../../include/hidpacket.h"
@@ -105,6 +108,7 @@ void s2s_configInit(S2S_BoardCfg* config)
 	else if ((blockDev.state & DISK_PRESENT) && sdDev.capacity)
 	{
 		int cfgSectors = (S2S_CFG_SIZE + 511) / 512;
+		scsiDiskQuiesce();
 		BSP_SD_ReadBlocks_DMA(
 			&s2s_cfg[0],
 			sdDev.capacity - cfgSectors,
@@ -213,7 +217,7 @@ scsiDevInfoCommand()
 static void
 debugCommand()
 {
-	uint8_t response[32];
+	uint8_t response[42];
 	memcpy(&response, &scsiDev.cdb, 12);
 	response[12] = scsiDev.msgIn;
 	response[13] = scsiDev.msgOut;
@@ -235,6 +239,59 @@ debugCommand()
 	response[29] = *SCSI_STS_DBX & 0xff; // What we've read
 	response[30] = *SCSI_STS_SELECTED;
 	response[31] = *SCSI_STS_DBX >> 8; // What we're writing
+	response[32] = s2s_cacheStats.hits >> 24;
+	response[33] = s2s_cacheStats.hits >> 16;
+	response[34] = s2s_cacheStats.hits >> 8;
+	response[35] = s2s_cacheStats.hits;
+	response[36] = s2s_cacheStats.misses >> 24;
+	response[37] = s2s_cacheStats.misses >> 16;
+	response[38] = s2s_cacheStats.misses >> 8;
+	response[39] = s2s_cacheStats.misses;
+	response[40] = scsiDev.maxSelWakeUs >> 8;
+	response[41] = scsiDev.maxSelWakeUs;
+	hidPacket_send(response, sizeof(response));
+}
+
+static void
+traceCommand(const uint8_t* cmd, size_t cmdSize)
+{
+	if (cmdSize < 5)
+	{
+		return; // ignore.
+	}
+	uint32_t seq =
+		(((uint32_t)cmd[1]) << 24) |
+		(((uint32_t)cmd[2]) << 16) |
+		(((uint32_t)cmd[3]) << 8) |
+		((uint32_t)cmd[4]);
+
+	uint8_t response[9 + S2S_TRACE_MAX_RECORDS * S2S_TRACE_RECORD_LEN];
+	uint32_t next;
+	int count = s2s_traceRead(seq, &response[9], S2S_TRACE_MAX_RECORDS, &next);
+	uint32_t cpuFreq = s2s_cpu_freq;
+
+	response[0] = next >> 24;
+	response[1] = next >> 16;
+	response[2] = next >> 8;
+	response[3] = next;
+	response[4] = cpuFreq >> 24;
+	response[5] = cpuFreq >> 16;
+	response[6] = cpuFreq >> 8;
+	response[7] = cpuFreq;
+	response[8] = count;
+	hidPacket_send(response, 9 + count * S2S_TRACE_RECORD_LEN);
+}
+
+static void
+statsCommand(const uint8_t* cmd, size_t cmdSize)
+{
+	if (cmdSize < 2)
+	{
+		return; // ignore.
+	}
+
+	uint8_t response[S2S_STATS_LEN];
+	s2s_statsRead(cmd[1], response);
 	hidPacket_send(response, sizeof(response));
 }
 
@@ -252,6 +309,8 @@ sdWriteCommand(const uint8_t* cmd, size_t cmdSize)
 		((uint32_t)cmd[4]);
 
 	memcpy(configDmaBuf, &cmd[5], 512);
+	scsiDiskQuiesce();
+	s2s_cacheInvalidate(lba, 1);
 	BSP_SD_WriteBlocks_DMA(configDmaBuf, lba, 1);
 
 	uint8_t response[] =
@@ -274,6 +333,7 @@ sdReadCommand(const uint8_t* cmd, size_t cmdSize)
 		(((uint32_t)cmd[3]) << 8) |
 		((uint32_t)cmd[4]);
 
+	scsiDiskQuiesce();
 	BSP_SD_ReadBlocks_DMA(configDmaBuf, lba, 1);
 	hidPacket_send(configDmaBuf, 512);
 }
@@ -318,6 +378,14 @@ processCommand(const uint8_t* cmd, size_t cmdSize)
 		debugCommand();
 		break;
 
+	case S2S_CMD_TRACE:
+		traceCommand(cmd, cmdSize);
+		break;
+
+	case S2S_CMD_STATS:
+		statsCommand(cmd, cmdSize);
+		break;
+
 	case S2S_CMD_NONE: // invalid
 	default:
 		break;
@@ -353,28 +421,24 @@ void s2s_configPoll()
 		s2s_ledOff();
 	}
 
-	switch (usbInEpState)
+	if ((usbInEpState == USB_DATA_SENT) && !USBD_HID_IsBusy(&configUsbDev))
 	{
-	case USB_IDLE:
-		{
-			uint8_t hidBuffer[USBHID_LEN];
-			const uint8_t* nextChunk = hidPacket_getHIDBytes(hidBuffer);
+		// Data accepted.
+		usbInEpState = USB_IDLE;
+	}
 
-			if (nextChunk)
-			{
-				USBD_HID_SendReport (&configUsbDev, nextChunk, sizeof(hidBuffer));
-				usbInEpState = USB_DATA_SENT;
-			}
-		}
-		break;
+	// Send the next chunk straight away. mainLoop may sleep until the
+	// next interrupt after this.
+	if (usbInEpState == USB_IDLE)
+	{
+		uint8_t hidBuffer[USBHID_LEN];
+		const uint8_t* nextChunk = hidPacket_getHIDBytes(hidBuffer);
 
-	case USB_DATA_SENT:
-		if (!USBD_HID_IsBusy(&configUsbDev))
+		if (nextChunk)
 		{
-			// Data accepted.
-			usbInEpState = USB_IDLE;
+			USBD_HID_SendReport (&configUsbDev, nextChunk, sizeof(hidBuffer));
+			usbInEpState = USB_DATA_SENT;
 		}
-		break;
 	}
 
 out:
@@ -446,6 +510,10 @@ void s2s_configSave(int scsiId, uint16_t bytesPerSector)
 	S2S_TargetCfg* cfg = (S2S_TargetCfg*) s2s_getConfigById(scsiId);
 	cfg->bytesPerSector = bytesPerSector;
 
+	scsiDiskQuiesce();
+	s2s_cacheInvalidate(
+		sdDev.capacity - S2S_CFG_SIZE,
+		(S2S_CFG_SIZE + 511) / 512);
 	BSP_SD_WriteBlocks_DMA(
 		&s2s_cfg[0],
 		sdDev.capacity - S2S_CFG_SIZE,
@@ -37,6 +37,8 @@
 #include "sd.h"
 #include "time.h"
 #include "bsp.h"
+#include "cache.h"
+#include "trace.h"
 
 #include <string.h>
 
@@ -44,6 +46,138 @@
 BlockDevice blockDev;
 Transfer transfer;
 
+// Sequential read detection, per target.
+typedef struct
+{
+	uint32_t nextLBA; // The lba following the last READ command
+	int sequential; // Number of back-to-back sequential READ commands
+} ReadStream;
+
+static ReadStream readStreams[S2S_MAX_TARGETS];
+
+// Emulated access time. The data or status phase of the command is held
+// back until the delay has elapsed, but the main loop keeps running.
+typedef struct
+{
+	uint32_t start; // s2s_getTime_ms() at the start of the access
+	uint32_t delay; // Milliseconds. 0 if the target is ready.
+} SeekDelay;
+
+static SeekDelay seekDelays[S2S_MAX_TARGETS];
+
+// Data read from the SD card in the background after a READ command
+// completed, in anticipation of the host reading the next blocks.
+// The data is stored at the start of scsiDev.data
+static struct
+{
+	TargetState* target;
+	uint32_t lba; // SCSI lba of the first block
+	uint32_t sdLBA;
+	uint32_t sdSectors; // Non-zero if a read-ahead is pending.
+	int complete; // The DMA has finished. The SD card is free.
+} readAhead;
+
+// Read-ahead is only started after this many sequential READ commands.
+#define READ_AHEAD_MIN_SEQUENTIAL 1
+
+static void cancelReadAhead()
+{
+	if (readAhead.sdSectors)
+	{
+		if (!readAhead.complete)
+		{
+			sdCompleteTransfer();
+		}
+		readAhead.sdSectors = 0;
+	}
+}
+
+// Returns non-zero if the SD card isn't busy with a read-ahead. A finished
+// read-ahead is kept in scsiDev.data for the next command, but doesn't hold
+// up background work.
+static int readAheadIdle()
+{
+	if (!readAhead.sdSectors)
+	{
+		return 1;
+	}
+	else if (!readAhead.complete &&
+		(HAL_SD_GetState(&hsd) != HAL_SD_STATE_BUSY))
+	{
+		sdReadDMAPoll(1);
+		if (hsd.ErrorCode == HAL_SD_ERROR_NONE)
+		{
+			readAhead.complete = 1;
+		}
+		else
+		{
+			readAhead.sdSectors = 0;
+		}
+	}
+	return !readAhead.sdSectors || readAhead.complete;
+}
+
+// Largest single READ or WRITE, in SD sectors. Keeps the byte count of a
+// transfer within 32 bits.
+#define MAX_TRANSFER_SD_SECTORS 0x400000
+
+// PRE-FETCH command state. Sectors are loaded into the cache one at a time
+// in the background.
+static struct
+{
+	uint32_t sdLBA; // Next sector to load
+	uint32_t sdSectors; // Remaining sectors to load
+	int dmaActive;
+} preFetch;
+
+// Dirty cache entries are written to the SD card in the background when the
+// write cache is enabled (WCE). Consecutive dirty sectors are written in a
+// single transaction. A run that sequential WRITE commands are still
+// extending is held back for a short time so it can grow.
+static struct
+{
+	uint32_t sdLBA; // First sector being written
+	uint32_t sectors;
+	int dmaActive;
+
+	// The most recent WRITE, which the next one may continue.
+	int open;
+	uint32_t nextLBA; // Sector following the last one written
+	uint32_t openTime; // s2s_getTime_ms() of the last WRITE
+	uint8_t cmdCount; // scsiDev.cmdCount of the last WRITE
+} writeBack;
+
+// Flush a held write run if it hasn't been extended within this time.
+#define WRITE_COALESCE_MS 10
+
+// Background fill of part of the SD card with a repeated logical block, for
+// FORMAT UNIT and WRITE SAME. One erase or write is started at a time, in
+// between other SD card activity.
+static struct
+{
+	TargetState* target; // NULL when idle
+	ScsiSense* sense; // Of the initiator that issued the command
+	uint32_t startLBA;
+	uint32_t sdLBA; // Next sector to fill
+	uint32_t sdSectors; // Remaining sectors to fill
+	uint32_t totalSectors;
+	uint32_t bufSectors; // Sectors of pattern data in fillBuf
+	int erase; // Zero fill using SD erase
+	int eraseChecked; // The card is known to erase to zero
+	uint32_t eraseLBA; // First sector of the last erase
+	int erasing; // The operation in progress is an erase
+	int async; // Background. Report progress and errors via sense data.
+	int busy; // Erase or write in progress
+	int error;
+} fill;
+
+// Whole logical blocks of the fill pattern, laid out as on the SD card.
+static uint8_t fillBuf[MAX_SECTOR_SIZE] S2S_DMA_ALIGN;
+
+// Erase in pieces so progress can be reported, and so commands for other
+// targets don't wait long for the SD card.
+#define FILL_ERASE_SECTORS 8192
+
 static int doSdInit()
 {
 	int result = 0;
@@ -54,25 +188,855 @@ static int doSdInit()
 	return result;
 }
 
-// Callback once all data has been read in the data out phase.
-static void doFormatUnitComplete(void)
-{
-	// TODO start writing the initialisation pattern to the SD
-	// card
-	scsiDev.phase = STATUS;
-}
+static void startSeekDelay(uint32_t delay)
+{
+	SeekDelay* seek = &seekDelays[scsiDev.target - scsiDev.targets];
+	seek->start = s2s_getTime_ms();
+	seek->delay = delay;
+}
+
+int scsiDiskSeekBusy()
+{
+	SeekDelay* seek = &seekDelays[scsiDev.target - scsiDev.targets];
+	if (likely(seek->delay == 0))
+	{
+		return 0;
+	}
+	else if (s2s_elapsedTime_ms(seek->start) <= seek->delay)
+	{
+		return 1;
+	}
+
+	seek->delay = 0;
+	return 0;
+}
+
+static void doReadCapacity()
+{
+	uint32_t lba = (((uint32_t) scsiDev.cdb[2]) << 24) +
+		(((uint32_t) scsiDev.cdb[3]) << 16) +
+		(((uint32_t) scsiDev.cdb[4]) << 8) +
+		scsiDev.cdb[5];
+	int pmi = scsiDev.cdb[8] & 1;
+
+	uint32_t capacity = getScsiCapacity(
+		scsiDev.target->cfg->sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->cfg->scsiSectors);
+
+	if (!pmi && lba)
+	{
+		// error.
+		// We don't do anything with the "partial medium indicator", and
+		// assume that delays are constant across each block. But the spec
+		// says we must return this error if pmi is specified incorrectly.
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
+		scsiDev.phase = STATUS;
+	}
+	else if (capacity > 0)
+	{
+		uint32_t highestBlock = capacity - 1;
+
+		scsiDev.data[0] = highestBlock >> 24;
+		scsiDev.data[1] = highestBlock >> 16;
+		scsiDev.data[2] = highestBlock >> 8;
+		scsiDev.data[3] = highestBlock;
+
+		uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+		scsiDev.data[4] = bytesPerSector >> 24;
+		scsiDev.data[5] = bytesPerSector >> 16;
+		scsiDev.data[6] = bytesPerSector >> 8;
+		scsiDev.data[7] = bytesPerSector;
+		scsiDev.dataLen = 8;
+		scsiDev.phase = DATA_IN;
+	}
+	else
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = NOT_READY;
+		scsiDev.target->sense->asc = MEDIUM_NOT_PRESENT;
+		scsiDev.phase = STATUS;
+	}
+}
+
+static void doReadCapacity16()
+{
+	uint64_t lba =
+		(((uint64_t) scsiDev.cdb[2]) << 56) +
+		(((uint64_t) scsiDev.cdb[3]) << 48) +
+		(((uint64_t) scsiDev.cdb[4]) << 40) +
+		(((uint64_t) scsiDev.cdb[5]) << 32) +
+		(((uint64_t) scsiDev.cdb[6]) << 24) +
+		(((uint64_t) scsiDev.cdb[7]) << 16) +
+		(((uint64_t) scsiDev.cdb[8]) << 8) +
+		scsiDev.cdb[9];
+	uint32_t allocLength =
+		(((uint32_t) scsiDev.cdb[10]) << 24) +
+		(((uint32_t) scsiDev.cdb[11]) << 16) +
+		(((uint32_t) scsiDev.cdb[12]) << 8) +
+		scsiDev.cdb[13];
+	int pmi = scsiDev.cdb[14] & 1;
+
+	uint32_t capacity = getScsiCapacity(
+		scsiDev.target->cfg->sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->cfg->scsiSectors);
+
+	if (!pmi && lba)
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
+		scsiDev.phase = STATUS;
+	}
+	else if (capacity > 0)
+	{
+		uint64_t highestBlock = capacity - 1;
+
+		memset(scsiDev.data, 0, 32);
+		scsiDev.data[0] = highestBlock >> 56;
+		scsiDev.data[1] = highestBlock >> 48;
+		scsiDev.data[2] = highestBlock >> 40;
+		scsiDev.data[3] = highestBlock >> 32;
+		scsiDev.data[4] = highestBlock >> 24;
+		scsiDev.data[5] = highestBlock >> 16;
+		scsiDev.data[6] = highestBlock >> 8;
+		scsiDev.data[7] = highestBlock;
+
+		uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+		scsiDev.data[8] = bytesPerSector >> 24;
+		scsiDev.data[9] = bytesPerSector >> 16;
+		scsiDev.data[10] = bytesPerSector >> 8;
+		scsiDev.data[11] = bytesPerSector;
+
+		// No protection information, one logical block per physical block.
+		scsiDev.dataLen = 32;
+		if (scsiDev.dataLen > allocLength)
+		{
+			scsiDev.dataLen = allocLength;
+		}
+		scsiDev.phase = DATA_IN;
+	}
+	else
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = NOT_READY;
+		scsiDev.target->sense->asc = MEDIUM_NOT_PRESENT;
+		scsiDev.phase = STATUS;
+	}
+}
+
+static int checkTransferLength(uint32_t blocks)
+{
+	uint64_t sdSectors = ((uint64_t) blocks) *
+		SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
+	if (unlikely(sdSectors > MAX_TRANSFER_SD_SECTORS))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
+		scsiDev.phase = STATUS;
+		return 0;
+	}
+	return 1;
+}
+
+static void doWrite(uint64_t lba, uint32_t blocks, int verify)
+{
+	if (unlikely(scsiDev.target->cfg->deviceType == S2S_CFG_FLOPPY_14MB)) {
+		// Floppies are supposed to be slow. Some systems can't handle a floppy
+		// without an access time
+		startSeekDelay(10);
+	}
+
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+
+	if (unlikely(blockDev.state & DISK_WP) ||
+		unlikely(scsiDev.target->cfg->deviceType == S2S_CFG_OPTICAL))
+
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = WRITE_PROTECTED;
+		scsiDev.phase = STATUS;
+	}
+	else if (unlikely(lba + blocks >
+		getScsiCapacity(
+			scsiDev.target->cfg->sdSectorStart,
+			bytesPerSector,
+			scsiDev.target->cfg->scsiSectors
+			)
+		) ||
+		unlikely(lba > UINT32_MAX))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else if (likely(checkTransferLength(blocks)))
+	{
+		transfer.lba = lba;
+		transfer.blocks = blocks;
+		transfer.currentBlock = 0;
+		transfer.verify = verify;
+		scsiDev.phase = DATA_OUT;
+		scsiDev.dataLen = bytesPerSector;
+		scsiDev.dataPtr = bytesPerSector;
+
+		// No need for single-block writes atm.  Overhead of the
+		// multi-block write is minimal.
+		transfer.multiBlock = 1;
+
+
+		// TODO uint32_t sdLBA =
+// TODO 			SCSISector2SD(
+	// TODO 			scsiDev.target->cfg->sdSectorStart,
+		// TODO 		bytesPerSector,
+			// TODO 	lba);
+		// TODO uint32_t sdBlocks = blocks * SDSectorsPerSCSISector(bytesPerSector);
+		// TODO sdWriteMultiSectorPrep(sdLBA, sdBlocks);
+	}
+}
+
+// VERIFY with BYTCHK set. The host sends the data, which is compared with
+// the medium in the DATA_OUT phase.
+static void doVerify(uint32_t lba, uint32_t blocks)
+{
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+
+	if (unlikely(((uint64_t) lba) + blocks >
+		getScsiCapacity(
+			scsiDev.target->cfg->sdSectorStart,
+			bytesPerSector,
+			scsiDev.target->cfg->scsiSectors)))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else if (blocks > 0 && likely(checkTransferLength(blocks)))
+	{
+		transfer.lba = lba;
+		transfer.blocks = blocks;
+		transfer.currentBlock = 0;
+		transfer.verify = VERIFY_ONLY;
+		transfer.multiBlock = 1;
+		scsiDev.phase = DATA_OUT;
+		scsiDev.dataLen = bytesPerSector;
+		scsiDev.dataPtr = bytesPerSector;
+	}
+}
+
+static void doRead(uint64_t lba, uint32_t blocks)
+{
+	if (unlikely(scsiDev.target->cfg->deviceType == S2S_CFG_FLOPPY_14MB)) {
+		// Floppies are supposed to be slow. Some systems can't handle a floppy
+		// without an access time
+		startSeekDelay(10);
+	}
+
+	uint32_t capacity = getScsiCapacity(
+		scsiDev.target->cfg->sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->cfg->scsiSectors);
+	if (unlikely(lba + blocks > capacity) || unlikely(lba > UINT32_MAX))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else if (likely(checkTransferLength(blocks)))
+	{
+		transfer.lba = lba;
+		transfer.blocks = blocks;
+		transfer.currentBlock = 0;
+		scsiDev.phase = DATA_IN;
+		scsiDev.dataLen = 0; // No data yet
+
+		uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+		uint32_t sdSectorPerSCSISector = SDSectorsPerSCSISector(bytesPerSector);
+		uint32_t sdSectors =
+			blocks * sdSectorPerSCSISector;
+
+		if ((
+				(sdSectors == 1) &&
+				!(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE)
+			) ||
+			unlikely(lba + blocks == capacity)
+			)
+		{
+			// We get errors on reading the last sector using a multi-sector
+			// read :-(
+			transfer.multiBlock = 0;
+		}
+		else
+		{
+			transfer.multiBlock = 1;
+
+			// uint32_t sdLBA =
+				// SCSISector2SD(
+					// scsiDev.target->cfg->sdSectorStart,
+					// bytesPerSector,
+					// lba);
+
+			// TODO sdReadMultiSectorPrep(sdLBA, sdSectors);
+		}
+	}
+}
+
+static void doSeek(uint32_t lba)
+{
+	if (lba >=
+		getScsiCapacity(
+			scsiDev.target->cfg->sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->cfg->scsiSectors)
+		)
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else
+	{
+		startSeekDelay(10);
+	}
+}
+
+static void pollPreFetch()
+{
+	if (preFetch.dmaActive)
+	{
+		if (sdReadDMAPoll(1))
+		{
+			preFetch.dmaActive = 0;
+			if (hsd.ErrorCode == HAL_SD_ERROR_NONE)
+			{
+				s2s_cacheCommit(preFetch.sdLBA);
+				preFetch.sdLBA++;
+				preFetch.sdSectors--;
+			}
+			else
+			{
+				preFetch.sdSectors = 0;
+			}
+		}
+	}
+	else if (preFetch.sdSectors && readAheadIdle())
+	{
+		if (s2s_cacheContains(preFetch.sdLBA, 1))
+		{
+			preFetch.sdLBA++;
+			preFetch.sdSectors--;
+			return;
+		}
+
+		uint8_t* buf = s2s_cacheAllocate(preFetch.sdLBA);
+		if (buf && sdStartReadDMA(preFetch.sdLBA, 1, buf))
+		{
+			preFetch.dmaActive = 1;
+		}
+		else
+		{
+			preFetch.sdSectors = 0;
+		}
+	}
+}
+
+// Let any background cache load complete before using the SD card.
+static void waitPreFetch()
+{
+	while (preFetch.dmaActive)
+	{
+		pollPreFetch();
+	}
+}
+
+static void endFill(int error)
+{
+	if (error && fill.async)
+	{
+		// Deferred error, returned by the next REQUEST SENSE.
+		fill.sense->code = MEDIUM_ERROR;
+		fill.sense->asc = FORMAT_COMMAND_FAILED;
+		fill.sense->deferred = 1;
+	}
+	fill.error = error;
+	fill.target = NULL;
+	fill.sdSectors = 0;
+}
+
+static int isZero(const uint8_t* data, uint32_t bytes)
+{
+	for (uint32_t i = 0; i < bytes; ++i)
+	{
+		if (data[i])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Complete the current erase or write, or start the next one.
+static void pollFill()
+{
+	if (fill.busy)
+	{
+		if ((HAL_SD_GetState(&hsd) == HAL_SD_STATE_BUSY) ||
+			(HAL_SD_GetCardState(&hsd) == HAL_SD_CARD_PROGRAMMING))
+		{
+			return;
+		}
+
+		fill.busy = 0;
+		if (hsd.ErrorCode != HAL_SD_ERROR_NONE)
+		{
+			endFill(1);
+		}
+		else if (fill.erasing && !fill.eraseChecked)
+		{
+			// Cards erase to either all zeros or all ones.
+			fill.eraseChecked = 1;
+			if ((BSP_SD_ReadBlocks_DMA(fillBuf, fill.eraseLBA, 1) != MSD_OK) ||
+				!isZero(fillBuf, SD_SECTOR_SIZE))
+			{
+				// Write zeros instead, from the start.
+				memset(fillBuf, 0, sizeof(fillBuf));
+				fill.erase = 0;
+				fill.sdSectors = fill.totalSectors;
+				fill.sdLBA = fill.startLBA;
+			}
+		}
+		return;
+	}
+
+	if (!fill.target)
+	{
+		return;
+	}
+	else if (fill.sdSectors == 0)
+	{
+		endFill(0);
+		return;
+	}
+
+	// Some cards can only erase whole erase groups. Partial groups at
+	// either end are written with zeros instead.
+	uint32_t group = sdDev.eraseSectors;
+	uint32_t misalign = fill.sdLBA % group;
+	int useErase = fill.erase && !misalign && (fill.sdSectors >= group);
+
+	uint32_t sectors = fill.sdSectors;
+	if (useErase)
+	{
+		uint32_t maxErase = FILL_ERASE_SECTORS - (FILL_ERASE_SECTORS % group);
+		sectors = sectors < maxErase ? sectors : maxErase;
+		sectors -= sectors % group;
+		if (BSP_SD_Erase(fill.sdLBA, fill.sdLBA + sectors - 1) != MSD_OK)
+		{
+			// Not supported by the card. fillBuf is already zeroed.
+			fill.erase = 0;
+			return;
+		}
+		fill.eraseLBA = fill.sdLBA;
+	}
+	else
+	{
+		if (fill.erase && misalign && (sectors > group - misalign))
+		{
+			sectors = group - misalign;
+		}
+		sectors = sectors < fill.bufSectors ? sectors : fill.bufSectors;
+		if (HAL_SD_WriteBlocks_DMA(&hsd, fillBuf, fill.sdLBA, sectors) != HAL_OK)
+		{
+			endFill(1);
+			return;
+		}
+	}
+
+	fill.sdLBA += sectors;
+	fill.sdSectors -= sectors;
+	fill.erasing = useErase;
+	fill.busy = 1;
+}
+
+// Let the fill erase or write in flight complete before using the SD card.
+// The rest of the fill carries on from pollFill afterwards.
+static void waitFill()
+{
+	while (fill.busy)
+	{
+		pollFill();
+	}
+}
+
+// Returns non-zero if the dirty run ends where the last WRITE did, and the
+// next command may still extend it.
+static int isWriteOpen(uint32_t sdLBA, uint32_t sectors)
+{
+	uint32_t limit = scsiDev.boardCfg.writeCoalesce;
+	if (limit > S2S_CACHE_SECTORS)
+	{
+		limit = S2S_CACHE_SECTORS;
+	}
+
+	return writeBack.open &&
+		(sdLBA + sectors == writeBack.nextLBA) &&
+		(sectors < limit) &&
+		(scsiDev.cmdCount == writeBack.cmdCount) && // No other command since
+		(s2s_elapsedTime_ms(writeBack.openTime) < WRITE_COALESCE_MS);
+}
+
+// The initiator that wrote the sectors isn't known, so every initiator of
+// the target that owns them gets a deferred error on its next command.
+static void writeBackFailed(uint32_t sdLBA, uint32_t sectors)
+{
+	for (int i = 0; i < S2S_MAX_TARGETS; ++i)
+	{
+		TargetState* target = &scsiDev.targets[i];
+		if (target->cfg)
+		{
+			uint16_t bytesPerSector = target->liveCfg.bytesPerSector;
+			uint32_t start = target->cfg->sdSectorStart;
+			uint32_t end = start +
+				getScsiCapacity(start, bytesPerSector, target->cfg->scsiSectors) *
+				SDSectorsPerSCSISector(bytesPerSector);
+
+			if ((sdLBA < end) && (sdLBA + sectors > start))
+			{
+				for (int j = 0; j < 8; ++j)
+				{
+					target->deferredError[j] = PERIPHERAL_DEVICE_WRITE_FAULT;
+				}
+			}
+		}
+	}
+}
+
+static void pollWriteBack()
+{
+	if (writeBack.dmaActive)
+	{
+		if ((HAL_SD_GetState(&hsd) == HAL_SD_STATE_BUSY) ||
+			(HAL_SD_GetCardState(&hsd) == HAL_SD_CARD_PROGRAMMING))
+		{
+			return;
+		}
+
+		writeBack.dmaActive = 0;
+		if (hsd.ErrorCode == HAL_SD_ERROR_NONE)
+		{
+			s2s_cacheClean(writeBack.sdLBA, writeBack.sectors);
+		}
+		else
+		{
+			// Don't retry forever. The card may have been removed.
+			writeBackFailed(writeBack.sdLBA, writeBack.sectors);
+			s2s_cacheInvalidate(writeBack.sdLBA, writeBack.sectors);
+		}
+	}
+	else
+	{
+		uint32_t sdLBA;
+		uint32_t sectors;
+		const uint8_t* buf = s2s_cacheNextDirty(&sdLBA, &sectors);
+		if (!buf || isWriteOpen(sdLBA, sectors))
+		{
+			return;
+		}
+
+		if (HAL_SD_WriteBlocks_DMA(&hsd, (uint8_t*) buf, sdLBA, sectors) == HAL_OK)
+		{
+			writeBack.sdLBA = sdLBA;
+			writeBack.sectors = sectors;
+			writeBack.dmaActive = 1;
+		}
+		else
+		{
+			writeBackFailed(sdLBA, sectors);
+			s2s_cacheInvalidate(sdLBA, sectors);
+		}
+	}
+}
+
+// Let any background cache write complete before using the SD card.
+static void waitWriteBack()
+{
+	waitFill();
+	while (writeBack.dmaActive)
+	{
+		pollWriteBack();
+	}
+}
+
+// Before a READ or WRITE data phase. A FORMAT UNIT of another target only
+// holds the SD card for the erase or write in flight, and carries on once
+// the transfer is done. The target being formatted reports NOT READY, so
+// its commands never get this far.
+static void waitDataPhase()
+{
+	waitPreFetch();
+	waitFill();
+	while (writeBack.dmaActive)
+	{
+		pollWriteBack();
+	}
+}
+
+// Write every dirty sector to the SD card.
+static void flushWriteBack()
+{
+	uint32_t sdLBA;
+	uint32_t sectors;
+	waitFill();
+	writeBack.open = 0;
+	while (writeBack.dmaActive || s2s_cacheNextDirty(&sdLBA, &sectors))
+	{
+		pollWriteBack();
+	}
+}
+
+// Returns non-zero once a write started with HAL_SD_WriteBlocks_DMA has
+// been programmed.
+static int sdWriteDone()
+{
+	if ((HAL_SD_GetState(&hsd) == HAL_SD_STATE_BUSY) ||
+		(HAL_SD_GetCardState(&hsd) == HAL_SD_CARD_PROGRAMMING))
+	{
+		return 0;
+	}
+	s2s_traceSdDone();
+	return 1;
+}
+
+static void waitSDWrite()
+{
+	while (!sdWriteDone())
+	{
+		// Wait while keeping BSY.
+	}
+}
+
+// Store written sectors in the cache, to be written to the SD card later.
+static void writeBackSectors(uint32_t sdLBA, uint32_t sectors, uint8_t* data)
+{
+	for (uint32_t i = 0; i < sectors; ++i)
+	{
+		uint8_t* sector = &data[SD_SECTOR_SIZE * i];
+		while (!s2s_cacheWrite(sdLBA + i, sector))
+		{
+			uint32_t dirtyLBA;
+			uint32_t dirtySectors;
+			writeBack.open = 0; // Make room now
+			if (!writeBack.dmaActive && !s2s_cacheNextDirty(&dirtyLBA, &dirtySectors))
+			{
+				// Every entry is locked. Write-through instead.
+				// Errors are deferred like those of background writes.
+				if (BSP_SD_WriteBlocks_DMA(sector, sdLBA + i, 1) != MSD_OK)
+				{
+					writeBackFailed(sdLBA + i, 1);
+				}
+				else
+				{
+					waitSDWrite();
+					if (hsd.ErrorCode != HAL_SD_ERROR_NONE)
+					{
+						writeBackFailed(sdLBA + i, 1);
+					}
+				}
+				break;
+			}
+			pollWriteBack();
+		}
+	}
+
+	writeBack.open = 1;
+	writeBack.nextLBA = sdLBA + sectors;
+	writeBack.openTime = s2s_getTime_ms();
+	writeBack.cmdCount = scsiDev.cmdCount;
+}
+
+static void doSynchronizeCache()
+{
+	// Always write everything. The range and IMMED bit are ignored, the
+	// cache is small.
+	flushWriteBack();
+
+	// Errors from before this command were reported when it was received.
+	uint16_t asc = scsiDev.target->deferredError[scsiDev.initiatorId];
+	if (asc)
+	{
+		scsiDev.target->deferredError[scsiDev.initiatorId] = 0;
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = MEDIUM_ERROR;
+		scsiDev.target->sense->asc = asc;
+		scsiDev.phase = STATUS;
+	}
+}
+
+// Start filling logical blocks with copies of block. FORMAT UNIT runs in
+// the background, WRITE SAME waits until it's finished.
+static void startFill(uint32_t lba, uint32_t blocks, const uint8_t* block, int async)
+{
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	int sdPerScsi = SDSectorsPerSCSISector(bytesPerSector);
+
+	if (fill.target)
+	{
+		// A FORMAT UNIT of another target is still running. There's only
+		// one fill, and the first initiator has already been sent GOOD
+		// status, so it can't be abandoned.
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = NOT_READY;
+		scsiDev.target->sense->asc = LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS;
+		return;
+	}
+
+	waitPreFetch();
+	waitWriteBack();
+
+	uint32_t blockBytes = sdPerScsi * SD_SECTOR_SIZE;
+	uint32_t copies = sizeof(fillBuf) / blockBytes;
+	memset(fillBuf, 0, sizeof(fillBuf));
+	for (uint32_t i = 0; i < copies; ++i)
+	{
+		memcpy(&fillBuf[i * blockBytes], block, bytesPerSector);
+	}
+
+	fill.target = scsiDev.target;
+	fill.sense = scsiDev.target->sense;
+	fill.startLBA =
+		SCSISector2SD(
+			scsiDev.target->cfg->sdSectorStart,
+			bytesPerSector,
+			lba);
+	fill.sdLBA = fill.startLBA;
+	fill.totalSectors = blocks * sdPerScsi;
+	fill.sdSectors = fill.totalSectors;
+	fill.bufSectors = copies * sdPerScsi;
+	fill.erase = isZero(block, bytesPerSector);
+	fill.eraseChecked = 0;
+	fill.erasing = 0;
+	fill.async = async;
+	fill.busy = 0;
+	fill.error = 0;
+
+	// Discard cached copies, including unwritten data.
+	s2s_cacheInvalidate(fill.startLBA, fill.totalSectors);
+
+	if (!async)
+	{
+		while (fill.target && likely(!scsiDev.resetFlag))
+		{
+			pollFill();
+		}
+		waitFill();
+
+		if (fill.target)
+		{
+			// Reset. Give up.
+			endFill(0);
+		}
+		else if (fill.error)
+		{
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense->code = MEDIUM_ERROR;
+			scsiDev.target->sense->asc = PERIPHERAL_DEVICE_WRITE_FAULT;
+		}
+	}
+}
+
+void scsiDiskErase(uint32_t lba, uint32_t blocks, int toEnd, int immed)
+{
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	uint32_t capacity = getScsiCapacity(
+		scsiDev.target->cfg->sdSectorStart,
+		bytesPerSector,
+		scsiDev.target->cfg->scsiSectors);
+
+	if (toEnd && lba < capacity)
+	{
+		blocks = capacity - lba;
+	}
+
+	if (unlikely(blockDev.state & DISK_WP))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = WRITE_PROTECTED;
+	}
+	else if (unlikely(((uint64_t) lba) + blocks > capacity))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+	}
+	else if (blocks > 0)
+	{
+		memset(scsiDev.data, 0, bytesPerSector);
+		startFill(lba, blocks, scsiDev.data, immed);
+	}
+	scsiDev.phase = STATUS;
+}
+
+int scsiDiskFormatBusy(uint16_t* progress)
+{
+	if (!fill.target || !fill.async || (fill.target != scsiDev.target))
+	{
+		return 0;
+	}
+
+	if (progress)
+	{
+		uint32_t done = fill.totalSectors - fill.sdSectors;
+		*progress = (((uint64_t) done) * 0xFFFF) / fill.totalSectors;
+	}
+	return 1;
+}
+
+static void doFormatUnitSkipData(int bytes)
+{
+	// We may not have enough memory to store the defect list data. Since
+	// we're not making use of it anyway, just discard the bytes.
+	scsiEnterPhase(DATA_OUT);
+	int parityError = 0;
+	while (bytes > 0)
+	{
+		int count = bytes < SCSI_FIFO_DEPTH ? bytes : SCSI_FIFO_DEPTH;
+		scsiRead(&scsiDev.data[0], count, &parityError);
+		bytes -= count;
+	}
+}
+
+// Callback once all data has been read in the data out phase.
+// Fills the whole medium with the pattern, if there is one.
+static void doFormatUnitComplete(const uint8_t* pattern, uint32_t patternLength)
+{
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	uint32_t capacity = getScsiCapacity(
+		scsiDev.target->cfg->sdSectorStart,
+		bytesPerSector,
+		scsiDev.target->cfg->scsiSectors);
+
+	// Build one logical block clear of the parameter list.
+	uint8_t* block = &scsiDev.data[MAX_SECTOR_SIZE * 2];
+	for (uint32_t i = 0; i < bytesPerSector; ++i)
+	{
+		block[i] = patternLength ? pattern[i % patternLength] : 0;
+	}
 
-static void doFormatUnitSkipData(int bytes)
-{
-	// We may not have enough memory to store the initialisation pattern and
-	// defect list data.  Since we're not making use of it yet anyway, just
-	// discard the bytes.
-	scsiEnterPhase(DATA_OUT);
-	int i;
-	for (i = 0; i < bytes; ++i)
+	if (capacity > 0)
 	{
-		scsiReadByte();
+		startFill(0, capacity, block, 1);
 	}
+	scsiDev.phase = STATUS;
 }
 
 // Callback from the data out phase.
@@ -82,12 +1046,44 @@ static void doFormatUnitPatternHeader(void)
 		((((uint16_t)scsiDev.data[2])) << 8) +
 			scsiDev.data[3];
 
+	int patternType = scsiDev.data[4 + 1];
 	int patternLength =
 		((((uint16_t)scsiDev.data[4 + 2])) << 8) +
 		scsiDev.data[4 + 3];
 
-		doFormatUnitSkipData(defectLength + patternLength);
-		doFormatUnitComplete();
+	// Only one logical block of the pattern is needed.
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	int keep = patternLength < bytesPerSector ? patternLength : bytesPerSector;
+	uint8_t* pattern = &scsiDev.data[8];
+
+	scsiEnterPhase(DATA_OUT);
+	int parityError = 0;
+	if (keep > 0)
+	{
+		scsiRead(pattern, keep, &parityError);
+	}
+	doFormatUnitSkipData(patternLength - keep + defectLength);
+
+	if (parityError &&
+		(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_PARITY))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ABORTED_COMMAND;
+		scsiDev.target->sense->asc = SCSI_PARITY_ERROR;
+		scsiDev.phase = STATUS;
+	}
+	else if (patternType > 1)
+	{
+		// 0 = default pattern (zeros), 1 = repeat the supplied pattern.
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_PARAMETER_LIST;
+		scsiDev.phase = STATUS;
+	}
+	else
+	{
+		doFormatUnitComplete(pattern, patternType ? keep : 0);
+	}
 }
 
 // Callback from the data out phase.
@@ -113,201 +1109,221 @@ static void doFormatUnitHeader(void)
 	}
 	else
 	{
-		// Read the defect list data
+		// Read the defect list data. Without an initialisation pattern the
+		// existing data is left as it is.
 		int defectLength =
 			((((uint16_t)scsiDev.data[2])) << 8) +
 			scsiDev.data[3];
 		doFormatUnitSkipData(defectLength);
-		doFormatUnitComplete();
+		scsiDev.phase = STATUS;
 	}
 }
 
-static void doReadCapacity()
+// WRITE SAME parameters, used once the data block arrives.
+static struct
 {
-	uint32_t lba = (((uint32_t) scsiDev.cdb[2]) << 24) +
-		(((uint32_t) scsiDev.cdb[3]) << 16) +
-		(((uint32_t) scsiDev.cdb[4]) << 8) +
-		scsiDev.cdb[5];
-	int pmi = scsiDev.cdb[8] & 1;
+	uint32_t lba;
+	uint32_t blocks;
+} writeSame;
+
+// Callback from the data out phase.
+static void doWriteSameData(void)
+{
+	startFill(writeSame.lba, writeSame.blocks, &scsiDev.data[0], 0);
+	scsiDev.phase = STATUS;
+}
 
+static void doWriteSame(uint32_t lba, uint32_t blocks)
+{
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
 	uint32_t capacity = getScsiCapacity(
 		scsiDev.target->cfg->sdSectorStart,
-		scsiDev.target->liveCfg.bytesPerSector,
+		bytesPerSector,
 		scsiDev.target->cfg->scsiSectors);
 
-	if (!pmi && lba)
+	if (blocks == 0 && lba < capacity)
 	{
-		// error.
-		// We don't do anything with the "partial medium indicator", and
-		// assume that delays are constant across each block. But the spec
-		// says we must return this error if pmi is specified incorrectly.
-		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
-		scsiDev.phase = STATUS;
+		// Up to the end of the medium.
+		blocks = capacity - lba;
 	}
-	else if (capacity > 0)
-	{
-		uint32_t highestBlock = capacity - 1;
-
-		scsiDev.data[0] = highestBlock >> 24;
-		scsiDev.data[1] = highestBlock >> 16;
-		scsiDev.data[2] = highestBlock >> 8;
-		scsiDev.data[3] = highestBlock;
 
-		uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
-		scsiDev.data[4] = bytesPerSector >> 24;
-		scsiDev.data[5] = bytesPerSector >> 16;
-		scsiDev.data[6] = bytesPerSector >> 8;
-		scsiDev.data[7] = bytesPerSector;
-		scsiDev.dataLen = 8;
-		scsiDev.phase = DATA_IN;
-	}
-	else
+	if (unlikely(blockDev.state & DISK_WP) ||
+		unlikely(scsiDev.target->cfg->deviceType == S2S_CFG_OPTICAL))
 	{
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = NOT_READY;
-		scsiDev.target->sense.asc = MEDIUM_NOT_PRESENT;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = WRITE_PROTECTED;
 		scsiDev.phase = STATUS;
 	}
-}
-
-static void doWrite(uint32_t lba, uint32_t blocks)
-{
-	if (unlikely(scsiDev.target->cfg->deviceType == S2S_CFG_FLOPPY_14MB)) {
-		// Floppies are supposed to be slow. Some systems can't handle a floppy
-		// without an access time
-		s2s_delay_ms(10);
-	}
-
-	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
-
-	if (unlikely(blockDev.state & DISK_WP) ||
-		unlikely(scsiDev.target->cfg->deviceType == S2S_CFG_OPTICAL))
-
+	else if (scsiDev.cdb[1] & 0x06)
 	{
+		// PBDATA and LBDATA aren't supported.
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = WRITE_PROTECTED;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		scsiDev.phase = STATUS;
 	}
-	else if (unlikely(((uint64_t) lba) + blocks >
-		getScsiCapacity(
-			scsiDev.target->cfg->sdSectorStart,
-			bytesPerSector,
-			scsiDev.target->cfg->scsiSectors
-			)
-		))
+	else if (unlikely(((uint64_t) lba) + blocks > capacity))
 	{
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
 		scsiDev.phase = STATUS;
 	}
 	else
 	{
-		transfer.lba = lba;
-		transfer.blocks = blocks;
-		transfer.currentBlock = 0;
-		scsiDev.phase = DATA_OUT;
+		writeSame.lba = lba;
+		writeSame.blocks = blocks;
 		scsiDev.dataLen = bytesPerSector;
-		scsiDev.dataPtr = bytesPerSector;
-
-		// No need for single-block writes atm.  Overhead of the
-		// multi-block write is minimal.
-		transfer.multiBlock = 1;
-
-
-		// TODO uint32_t sdLBA =
-// TODO 			SCSISector2SD(
-	// TODO 			scsiDev.target->cfg->sdSectorStart,
-		// TODO 		bytesPerSector,
-			// TODO 	lba);
-		// TODO uint32_t sdBlocks = blocks * SDSectorsPerSCSISector(bytesPerSector);
-		// TODO sdWriteMultiSectorPrep(sdLBA, sdBlocks);
+		scsiDev.phase = DATA_OUT;
+		scsiDev.postDataOutHook = doWriteSameData;
 	}
 }
 
-
-static void doRead(uint32_t lba, uint32_t blocks)
+// Force Unit Access bit of the current READ or WRITE command. The 6 byte
+// commands don't have one.
+static int isFUA()
 {
-	if (unlikely(scsiDev.target->cfg->deviceType == S2S_CFG_FLOPPY_14MB)) {
-		// Floppies are supposed to be slow. Some systems can't handle a floppy
-		// without an access time
-		s2s_delay_ms(10);
-	}
+	return (scsiDev.cdb[0] != 0x08) &&
+		(scsiDev.cdb[0] != 0x0A) &&
+		(scsiDev.cdb[1] & 0x08);
+}
 
+static int checkCacheRange(uint32_t lba, uint32_t* blocks)
+{
 	uint32_t capacity = getScsiCapacity(
 		scsiDev.target->cfg->sdSectorStart,
 		scsiDev.target->liveCfg.bytesPerSector,
 		scsiDev.target->cfg->scsiSectors);
-	if (unlikely(((uint64_t) lba) + blocks > capacity))
+
+	if (*blocks == 0 && lba < capacity)
+	{
+		// Up to the end of the medium.
+		*blocks = capacity - lba;
+	}
+
+	if (unlikely(((uint64_t) lba) + *blocks > capacity))
 	{
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
 		scsiDev.phase = STATUS;
+		return 0;
 	}
-	else
+	return 1;
+}
+
+static void doPreFetch(uint32_t lba, uint32_t blocks, int immed)
+{
+	if (!checkCacheRange(lba, &blocks) ||
+		!(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE))
 	{
-		transfer.lba = lba;
-		transfer.blocks = blocks;
-		transfer.currentBlock = 0;
-		scsiDev.phase = DATA_IN;
-		scsiDev.dataLen = 0; // No data yet
+		return;
+	}
 
-		uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
-		uint32_t sdSectorPerSCSISector = SDSectorsPerSCSISector(bytesPerSector);
-		uint32_t sdSectors =
-			blocks * sdSectorPerSCSISector;
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	uint32_t sdSectors = blocks * SDSectorsPerSCSISector(bytesPerSector);
+
+	// Replace any previous PRE-FETCH. Load as much as will fit.
+	waitPreFetch();
+	waitFill();
+	uint32_t available = s2s_cacheUnlockedSectors();
+	int fits = sdSectors <= available;
+	preFetch.sdLBA =
+		SCSISector2SD(
+			scsiDev.target->cfg->sdSectorStart,
+			bytesPerSector,
+			lba);
+	preFetch.sdSectors = fits ? sdSectors : available;
 
-		if ((
-				(sdSectors == 1) &&
-				!(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE)
-			) ||
-			unlikely(((uint64_t) lba) + blocks == capacity)
-			)
+	if (!immed)
+	{
+		while ((preFetch.sdSectors || preFetch.dmaActive) &&
+			likely(!scsiDev.resetFlag))
 		{
-			// We get errors on reading the last sector using a multi-sector
-			// read :-(
-			transfer.multiBlock = 0;
+			pollPreFetch();
 		}
-		else
-		{
-			transfer.multiBlock = 1;
-
-			// uint32_t sdLBA =
-				// SCSISector2SD(
-					// scsiDev.target->cfg->sdSectorStart,
-					// bytesPerSector,
-					// lba);
+	}
 
-			// TODO sdReadMultiSectorPrep(sdLBA, sdSectors);
-		}
+	// CONDITION MET indicates the cache has room for all the blocks.
+	if (fits)
+	{
+		scsiDev.status = CONDITION_MET;
+		scsiDev.phase = STATUS;
 	}
 }
 
-static void doSeek(uint32_t lba)
+static void doLockUnlockCache(uint32_t lba, uint32_t blocks, int lock)
 {
-	if (lba >=
-		getScsiCapacity(
+	if (!checkCacheRange(lba, &blocks) ||
+		!(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE))
+	{
+		return;
+	}
+
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	uint32_t sdSectors = blocks * SDSectorsPerSCSISector(bytesPerSector);
+	uint32_t sdLBA =
+		SCSISector2SD(
 			scsiDev.target->cfg->sdSectorStart,
-			scsiDev.target->liveCfg.bytesPerSector,
-			scsiDev.target->cfg->scsiSectors)
-		)
+			bytesPerSector,
+			lba);
+
+	if (!lock)
+	{
+		s2s_cacheSetLocked(sdLBA, sdSectors, 0);
+		return;
+	}
+
+	if (!s2s_cacheCanLock(sdLBA, sdSectors))
 	{
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = SYSTEM_RESOURCE_FAILURE;
 		scsiDev.phase = STATUS;
+		return;
 	}
-	else
+
+	// Pin whatever is already cached, then load the rest.
+	waitPreFetch();
+	flushWriteBack();
+	uint32_t wasLocked = 0; // sdSectors <= S2S_CACHE_SECTORS
+	for (uint32_t i = 0; i < sdSectors; ++i)
+	{
+		wasLocked |= s2s_cacheIsLocked(sdLBA + i) << i;
+	}
+	s2s_cacheSetLocked(sdLBA, sdSectors, 1);
+	for (uint32_t i = 0; i < sdSectors; ++i)
 	{
-		s2s_delay_ms(10);
+		if (s2s_cacheContains(sdLBA + i, 1))
+		{
+			continue;
+		}
+
+		uint8_t* buf = s2s_cacheAllocate(sdLBA + i);
+		if (!buf || (BSP_SD_ReadBlocks_DMA(buf, sdLBA + i, 1) != MSD_OK))
+		{
+			// The host won't unlock a range it was told wasn't locked.
+			for (uint32_t j = 0; j < sdSectors; ++j)
+			{
+				if (!(wasLocked & (1 << j)))
+				{
+					s2s_cacheSetLocked(sdLBA + j, 1, 0);
+				}
+			}
+
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense->code = MEDIUM_ERROR;
+			scsiDev.target->sense->asc = UNRECOVERED_READ_ERROR;
+			scsiDev.phase = STATUS;
+			return;
+		}
+		s2s_cacheCommit(sdLBA + i);
+		s2s_cacheSetLocked(sdLBA + i, 1, 1);
 	}
 }
 
-static int doTestUnitReady()
+int scsiDiskTestUnitReady()
 {
 	int ready = 1;
 	if (likely(blockDev.state == (DISK_STARTED | DISK_PRESENT | DISK_INITIALISED)))
@@ -318,24 +1334,24 @@ static int doTestUnitReady()
 	{
 		ready = 0;
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = NOT_READY;
-		scsiDev.target->sense.asc = LOGICAL_UNIT_NOT_READY_INITIALIZING_COMMAND_REQUIRED;
+		scsiDev.target->sense->code = NOT_READY;
+		scsiDev.target->sense->asc = LOGICAL_UNIT_NOT_READY_INITIALIZING_COMMAND_REQUIRED;
 		scsiDev.phase = STATUS;
 	}
 	else if (unlikely(!(blockDev.state & DISK_PRESENT)))
 	{
 		ready = 0;
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = NOT_READY;
-		scsiDev.target->sense.asc = MEDIUM_NOT_PRESENT;
+		scsiDev.target->sense->code = NOT_READY;
+		scsiDev.target->sense->asc = MEDIUM_NOT_PRESENT;
 		scsiDev.phase = STATUS;
 	}
 	else if (unlikely(!(blockDev.state & DISK_INITIALISED)))
 	{
 		ready = 0;
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = NOT_READY;
-		scsiDev.target->sense.asc = LOGICAL_UNIT_NOT_READY_CAUSE_NOT_REPORTABLE;
+		scsiDev.target->sense->code = NOT_READY;
+		scsiDev.target->sense->asc = LOGICAL_UNIT_NOT_READY_CAUSE_NOT_REPORTABLE;
 		scsiDev.phase = STATUS;
 	}
 	return ready;
@@ -371,11 +1387,7 @@ int scsiDiskCommand()
 	else if (unlikely(command == 0x00))
 	{
 		// TEST UNIT READY
-		doTestUnitReady();
-	}
-	else if (unlikely(!doTestUnitReady()))
-	{
-		// Status and sense codes already set by doTestUnitReady
+		scsiDiskTestUnitReady();
 	}
 	else if (likely(command == 0x08))
 	{
@@ -391,7 +1403,7 @@ int scsiDiskCommand()
 	else if (likely(command == 0x28))
 	{
 		// READ(10)
-		// Ignore all cache control bits - we don't support a memory cache.
+		// Ignore all cache control bits. Cached sectors are never stale.
 
 		uint32_t lba =
 			(((uint32_t) scsiDev.cdb[2]) << 24) +
@@ -404,6 +1416,42 @@ int scsiDiskCommand()
 
 		doRead(lba, blocks);
 	}
+	else if (unlikely(command == 0xA8))
+	{
+		// READ(12)
+		uint32_t lba =
+			(((uint32_t) scsiDev.cdb[2]) << 24) +
+			(((uint32_t) scsiDev.cdb[3]) << 16) +
+			(((uint32_t) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32_t blocks =
+			(((uint32_t) scsiDev.cdb[6]) << 24) +
+			(((uint32_t) scsiDev.cdb[7]) << 16) +
+			(((uint32_t) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
+
+		doRead(lba, blocks);
+	}
+	else if (unlikely(command == 0x88))
+	{
+		// READ(16)
+		uint64_t lba =
+			(((uint64_t) scsiDev.cdb[2]) << 56) +
+			(((uint64_t) scsiDev.cdb[3]) << 48) +
+			(((uint64_t) scsiDev.cdb[4]) << 40) +
+			(((uint64_t) scsiDev.cdb[5]) << 32) +
+			(((uint64_t) scsiDev.cdb[6]) << 24) +
+			(((uint64_t) scsiDev.cdb[7]) << 16) +
+			(((uint64_t) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
+		uint32_t blocks =
+			(((uint32_t) scsiDev.cdb[10]) << 24) +
+			(((uint32_t) scsiDev.cdb[11]) << 16) +
+			(((uint32_t) scsiDev.cdb[12]) << 8) +
+			scsiDev.cdb[13];
+
+		doRead(lba, blocks);
+	}
 	else if (likely(command == 0x0A))
 	{
 		// WRITE(6)
@@ -413,14 +1461,14 @@ int scsiDiskCommand()
 			scsiDev.cdb[3];
 		uint32_t blocks = scsiDev.cdb[4];
 		if (unlikely(blocks == 0)) blocks = 256;
-		doWrite(lba, blocks);
+		doWrite(lba, blocks, VERIFY_NONE);
 	}
 	else if (likely(command == 0x2A) || // WRITE(10)
 		unlikely(command == 0x2E)) // WRITE AND VERIFY
 	{
-		// Ignore all cache control bits - we don't support a memory cache.
-		// Don't bother verifying either. The SD card likely stores ECC
-		// along with each flash row.
+		// FUA is checked when the data arrives. DPO is ignored.
+		// WRITE AND VERIFY always compares the data, whether or not
+		// BYTCHK is set.
 
 		uint32_t lba =
 			(((uint32_t) scsiDev.cdb[2]) << 24) +
@@ -431,7 +1479,43 @@ int scsiDiskCommand()
 			(((uint32_t) scsiDev.cdb[7]) << 8) +
 			scsiDev.cdb[8];
 
-		doWrite(lba, blocks);
+		doWrite(lba, blocks, command == 0x2E ? VERIFY_AFTER_WRITE : VERIFY_NONE);
+	}
+	else if (unlikely(command == 0xAA) || // WRITE(12)
+		unlikely(command == 0xAE)) // WRITE AND VERIFY(12)
+	{
+		uint32_t lba =
+			(((uint32_t) scsiDev.cdb[2]) << 24) +
+			(((uint32_t) scsiDev.cdb[3]) << 16) +
+			(((uint32_t) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32_t blocks =
+			(((uint32_t) scsiDev.cdb[6]) << 24) +
+			(((uint32_t) scsiDev.cdb[7]) << 16) +
+			(((uint32_t) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
+
+		doWrite(lba, blocks, command == 0xAE ? VERIFY_AFTER_WRITE : VERIFY_NONE);
+	}
+	else if (unlikely(command == 0x8A) || // WRITE(16)
+		unlikely(command == 0x8E)) // WRITE AND VERIFY(16)
+	{
+		uint64_t lba =
+			(((uint64_t) scsiDev.cdb[2]) << 56) +
+			(((uint64_t) scsiDev.cdb[3]) << 48) +
+			(((uint64_t) scsiDev.cdb[4]) << 40) +
+			(((uint64_t) scsiDev.cdb[5]) << 32) +
+			(((uint64_t) scsiDev.cdb[6]) << 24) +
+			(((uint64_t) scsiDev.cdb[7]) << 16) +
+			(((uint64_t) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
+		uint32_t blocks =
+			(((uint32_t) scsiDev.cdb[10]) << 24) +
+			(((uint32_t) scsiDev.cdb[11]) << 16) +
+			(((uint32_t) scsiDev.cdb[12]) << 8) +
+			scsiDev.cdb[13];
+
+		doWrite(lba, blocks, command == 0x8E ? VERIFY_AFTER_WRITE : VERIFY_NONE);
 	}
 	else if (unlikely(command == 0x04))
 	{
@@ -453,11 +1537,31 @@ int scsiDiskCommand()
 			// No data to read, we're already finished!
 		}
 	}
+	else if (unlikely(command == 0x41))
+	{
+		// WRITE SAME(10)
+		uint32_t lba =
+			(((uint32_t) scsiDev.cdb[2]) << 24) +
+			(((uint32_t) scsiDev.cdb[3]) << 16) +
+			(((uint32_t) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32_t blocks =
+			(((uint32_t) scsiDev.cdb[7]) << 8) +
+			scsiDev.cdb[8];
+
+		doWriteSame(lba, blocks);
+	}
 	else if (unlikely(command == 0x25))
 	{
 		// READ CAPACITY
 		doReadCapacity();
 	}
+	else if (unlikely(command == 0x9E) &&
+		((scsiDev.cdb[1] & 0x1F) == 0x10))
+	{
+		// SERVICE ACTION IN(16), READ CAPACITY(16)
+		doReadCapacity16();
+	}
 	else if (unlikely(command == 0x0B))
 	{
 		// SEEK(6)
@@ -471,24 +1575,44 @@ int scsiDiskCommand()
 
 	else if (unlikely(command == 0x2B))
 	{
-		// SEEK(10)
+		// SEEK(10)
+		uint32_t lba =
+			(((uint32_t) scsiDev.cdb[2]) << 24) +
+			(((uint32_t) scsiDev.cdb[3]) << 16) +
+			(((uint32_t) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+
+		doSeek(lba);
+	}
+	else if (unlikely(command == 0x36))
+	{
+		// LOCK UNLOCK CACHE
+		int lock = scsiDev.cdb[1] & 0x02;
+		uint32_t lba =
+			(((uint32_t) scsiDev.cdb[2]) << 24) +
+			(((uint32_t) scsiDev.cdb[3]) << 16) +
+			(((uint32_t) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32_t blocks =
+			(((uint32_t) scsiDev.cdb[7]) << 8) +
+			scsiDev.cdb[8];
+
+		doLockUnlockCache(lba, blocks, lock);
+	}
+	else if (unlikely(command == 0x34))
+	{
+		// PRE-FETCH.
+		int immed = scsiDev.cdb[1] & 0x02;
 		uint32_t lba =
 			(((uint32_t) scsiDev.cdb[2]) << 24) +
 			(((uint32_t) scsiDev.cdb[3]) << 16) +
 			(((uint32_t) scsiDev.cdb[4]) << 8) +
 			scsiDev.cdb[5];
+		uint32_t blocks =
+			(((uint32_t) scsiDev.cdb[7]) << 8) +
+			scsiDev.cdb[8];
 
-		doSeek(lba);
-	}
-	else if (unlikely(command == 0x36))
-	{
-		// LOCK UNLOCK CACHE
-		// We don't have a cache to lock data into. do nothing.
-	}
-	else if (unlikely(command == 0x34))
-	{
-		// PRE-FETCH.
-		// We don't have a cache to pre-fetch into. do nothing.
+		doPreFetch(lba, blocks, immed);
 	}
 	else if (unlikely(command == 0x1E))
 	{
@@ -501,16 +1625,14 @@ int scsiDiskCommand()
 		// REZERO UNIT
 		// Set the lun to a vendor-specific state. Ignore.
 	}
-	else if (unlikely(command == 0x35))
+	else if (unlikely(command == 0x35) || unlikely(command == 0x91))
 	{
-		// SYNCHRONIZE CACHE
-		// We don't have a cache. do nothing.
+		// SYNCHRONIZE CACHE(10), SYNCHRONIZE CACHE(16)
+		doSynchronizeCache();
 	}
 	else if (unlikely(command == 0x2F))
 	{
 		// VERIFY
-		// TODO: When they supply data to verify, we should read the data and
-		// verify it. If they don't supply any data, just say success.
 		if ((scsiDev.cdb[1] & 0x02) == 0)
 		{
 			// They are asking us to do a medium verification with no data
@@ -518,12 +1640,17 @@ int scsiDiskCommand()
 		}
 		else
 		{
-			// TODO. This means they are supplying data to verify against.
-			// Technically we should probably grab the data and compare it.
-			scsiDev.status = CHECK_CONDITION;
-			scsiDev.target->sense.code = ILLEGAL_REQUEST;
-			scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
-			scsiDev.phase = STATUS;
+			// BYTCHK. Compare the supplied data with the medium.
+			uint32_t lba =
+				(((uint32_t) scsiDev.cdb[2]) << 24) +
+				(((uint32_t) scsiDev.cdb[3]) << 16) +
+				(((uint32_t) scsiDev.cdb[4]) << 8) +
+				scsiDev.cdb[5];
+			uint32_t blocks =
+				(((uint32_t) scsiDev.cdb[7]) << 8) +
+				scsiDev.cdb[8];
+
+			doVerify(lba, blocks);
 		}
 	}
 	else if (unlikely(command == 0x37))
@@ -553,15 +1680,272 @@ int scsiDiskCommand()
 	return commandHandled;
 }
 
+// Start reading the blocks following a sequential READ command while the
+// bus is busy with the STATUS and MESSAGE IN phases, and the host is
+// preparing the next command.
+static void startReadAhead(uint32_t lba, uint32_t prevSDSectors)
+{
+	ReadStream* stream = &readStreams[scsiDev.target - scsiDev.targets];
+	uint32_t dirtyLBA;
+	uint32_t dirtySectors;
+	if ((stream->sequential < READ_AHEAD_MIN_SEQUENTIAL) ||
+		s2s_cacheNextDirty(&dirtyLBA, &dirtySectors))
+	{
+		// Let the write cache drain first.
+		return;
+	}
+
+	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	const int sdPerScsi = SDSectorsPerSCSISector(bytesPerSector);
+	uint32_t capacity = getScsiCapacity(
+		scsiDev.target->cfg->sdSectorStart,
+		bytesPerSector,
+		scsiDev.target->cfg->scsiSectors);
+
+	// We get errors on reading the last sector using a multi-sector
+	// read, so never read-ahead that far.
+	if (((uint64_t) lba) + 1 >= capacity)
+	{
+		return;
+	}
+
+	// Assume the host will keep using the same transfer size.
+	uint32_t blocks = prevSDSectors / sdPerScsi;
+	uint32_t maxBlocks = 128 / sdPerScsi; // 65536 DMA limit !!
+	if (blocks > maxBlocks) blocks = maxBlocks;
+	if (blocks > capacity - 1 - lba) blocks = capacity - 1 - lba;
+	if (blocks == 0)
+	{
+		return;
+	}
+
+	uint32_t sdSectors = blocks * sdPerScsi;
+	uint32_t sdLBA =
+		SCSISector2SD(
+			scsiDev.target->cfg->sdSectorStart,
+			bytesPerSector,
+			lba);
+
+	if (sdStartReadDMA(sdLBA, sdSectors, &scsiDev.data[0]))
+	{
+		readAhead.target = scsiDev.target;
+		readAhead.lba = lba;
+		readAhead.sdLBA = sdLBA;
+		readAhead.sdSectors = sdSectors;
+		readAhead.complete = 0;
+	}
+}
+
+void scsiDiskCheckReadAhead()
+{
+	if (likely(!readAhead.sdSectors))
+	{
+		return;
+	}
+
+	// Keep the read-ahead data only if this command is going to use it.
+	// Anything else is likely to overwrite scsiDev.data
+	uint8_t command = scsiDev.cdb[0];
+	uint64_t lba;
+	if (command == 0x08)
+	{
+		// READ(6)
+		lba =
+			(((uint32_t) scsiDev.cdb[1] & 0x1F) << 16) +
+			(((uint32_t) scsiDev.cdb[2]) << 8) +
+			scsiDev.cdb[3];
+	}
+	else if ((command == 0x28) || (command == 0xA8))
+	{
+		// READ(10), READ(12)
+		lba =
+			(((uint32_t) scsiDev.cdb[2]) << 24) +
+			(((uint32_t) scsiDev.cdb[3]) << 16) +
+			(((uint32_t) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+	}
+	else if (command == 0x88)
+	{
+		// READ(16)
+		lba =
+			(((uint64_t) scsiDev.cdb[2]) << 56) +
+			(((uint64_t) scsiDev.cdb[3]) << 48) +
+			(((uint64_t) scsiDev.cdb[4]) << 40) +
+			(((uint64_t) scsiDev.cdb[5]) << 32) +
+			(((uint64_t) scsiDev.cdb[6]) << 24) +
+			(((uint64_t) scsiDev.cdb[7]) << 16) +
+			(((uint64_t) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
+	}
+	else
+	{
+		cancelReadAhead();
+		return;
+	}
+
+	if ((scsiDev.target != readAhead.target) ||
+		(scsiDev.lun != 0) ||
+		(lba != readAhead.lba))
+	{
+		cancelReadAhead();
+	}
+}
+
+int scsiDiskIdle()
+{
+	uint32_t sdLBA;
+	uint32_t sectors;
+	return readAheadIdle() &&
+		!preFetch.sdSectors &&
+		!preFetch.dmaActive &&
+		!writeBack.dmaActive &&
+		!fill.target &&
+		!fill.busy &&
+		(!s2s_cacheNextDirty(&sdLBA, &sectors) || isWriteOpen(sdLBA, sectors));
+}
+
+void scsiDiskQuiesce()
+{
+	cancelReadAhead();
+	waitPreFetch();
+	flushWriteBack();
+}
+
+// Number of valid bytes in an SD sector. Only the start of the last SD
+// sector of each SCSI sector is used when the SCSI sector size isn't a
+// multiple of 512.
+static inline uint32_t
+sdSectorBytes(int sdSector, int sdPerScsi, uint32_t bytesPerSector)
+{
+	if ((sdSector % sdPerScsi) == (sdPerScsi - 1))
+	{
+		uint32_t bytes = bytesPerSector % SD_SECTOR_SIZE;
+		return bytes ? bytes : SD_SECTOR_SIZE;
+	}
+	return SD_SECTOR_SIZE;
+}
+
+// Read-back buffer for VERIFY and WRITE AND VERIFY.
+static uint8_t verifyBuf[SD_SECTOR_SIZE * 8] S2S_DMA_ALIGN;
+
+// Compare SD card sectors with the data received from the host. data holds
+// one SD sector per 512 bytes, starting at SD sector "first" of the
+// transfer. Sets the sense data and returns 0 on a miscompare or read error.
+static int compareSectors(
+	uint32_t sdLBA,
+	int first,
+	uint32_t sectors,
+	const uint8_t* data,
+	int sdPerScsi,
+	uint32_t bytesPerSector)
+{
+	const uint32_t maxSectors = sizeof(verifyBuf) / SD_SECTOR_SIZE;
+	for (uint32_t i = 0; i < sectors; i += maxSectors)
+	{
+		uint32_t count = sectors - i < maxSectors ? sectors - i : maxSectors;
+		if (BSP_SD_ReadBlocks_DMA(verifyBuf, sdLBA + i, count) != MSD_OK)
+		{
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense->code = MEDIUM_ERROR;
+			scsiDev.target->sense->asc = UNRECOVERED_READ_ERROR;
+			return 0;
+		}
+
+		for (uint32_t j = 0; j < count; ++j)
+		{
+			uint32_t bytes = sdSectorBytes(first + i + j, sdPerScsi, bytesPerSector);
+			if (memcmp(
+				&verifyBuf[SD_SECTOR_SIZE * j],
+				&data[SD_SECTOR_SIZE * (i + j)],
+				bytes))
+			{
+				scsiDev.status = CHECK_CONDITION;
+				scsiDev.target->sense->code = MISCOMPARE;
+				scsiDev.target->sense->asc = MISCOMPARE_DURING_VERIFY_OPERATION;
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+// Host speed estimates older than this are discarded. The host may be
+// running something else entirely by now.
+#define HOST_SPEED_MAX_AGE_MS 30000
+
+// The weight of older samples halves after this long.
+#define HOST_SPEED_DECAY_MS 5000
+
+static HostSpeed* getHostSpeed()
+{
+	// Hosts that don't identify themselves during selection share the slot
+	// for ID 7, the usual host ID.
+	HostSpeed* host = &scsiDev.hostSpeed[scsiDev.initiatorId & 7];
+
+	if (host->measured &&
+		((host->syncPeriod != scsiDev.target->syncPeriod) ||
+			(host->syncOffset != scsiDev.target->syncOffset) ||
+			(s2s_elapsedTime_ms(host->sampleTime) > HOST_SPEED_MAX_AGE_MS)))
+	{
+		// Measured with a different sync agreement, or too long ago.
+		memset(host, 0, sizeof(*host));
+	}
+
+	if (host->underrunCount &&
+		(s2s_elapsedTime_ms(host->underrunTime) > HOST_SPEED_DECAY_MS))
+	{
+		host->underrunCount /= 2;
+		host->underrunTime = s2s_getTime_ms();
+	}
+
+	return host;
+}
+
+static void addHostSpeedSample(HostSpeed* host, uint32_t rateKBs)
+{
+	// Drop quickly, rise slowly. Over-estimating the host speed causes
+	// blind write underruns.
+	if (!host->measured || (rateKBs < host->speedKBs))
+	{
+		host->speedKBs = rateKBs;
+	}
+	else if (s2s_elapsedTime_ms(host->sampleTime) > HOST_SPEED_DECAY_MS)
+	{
+		host->speedKBs = (host->speedKBs + rateKBs) / 2;
+	}
+	else
+	{
+		host->speedKBs = (host->speedKBs * 3 + rateKBs) / 4;
+	}
+
+	host->sampleTime = s2s_getTime_ms();
+	host->syncPeriod = scsiDev.target->syncPeriod;
+	host->syncOffset = scsiDev.target->syncOffset;
+	host->measured = 1;
+}
+
+static uint32_t calcRateKBs(uint32_t bytes, uint32_t elapsedCycles)
+{
+	if (elapsedCycles == 0)
+	{
+		elapsedCycles = 1;
+	}
+
+	// uint32_t rateKBs = (bytes / 1000) / (elapsedCycles / HAL_RCC_GetHCLKFreq());
+	// Scaled by 4 to avoid overflow w/ max 65536 at 108MHz.
+	return ((bytes / 4) * (HAL_RCC_GetHCLKFreq() / 1000) / elapsedCycles) * 4;
+}
+
 static uint32_t
-calcReadahead(uint32_t totalBytes, uint32_t sdSpeedKBs, uint32_t scsiSpeedKBs)
+calcReadahead(uint32_t totalBytes, uint32_t sdSpeedKBs, const HostSpeed* host)
 {
 	if (!(scsiDev.boardCfg.flags6 & S2S_CFG_ENABLE_BLIND_WRITES) ||
-		(scsiSpeedKBs == 0) ||
-		(scsiDev.hostSpeedMeasured == 0))
+		!host->measured ||
+		(host->speedKBs == 0))
 	{
 		return totalBytes;
 	}
+	uint32_t scsiSpeedKBs = host->speedKBs;
 
 	// uint32_t readAheadBytes = totalBytes * (1 - scsiSpeedKBs / sdSpeedKBs);
 	// Won't overflow with 65536 max bytes, 20000 max scsi speed.
@@ -583,8 +1967,11 @@ void scsiDiskPoll()
 	uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
 
 	if (scsiDev.phase == DATA_IN &&
-		transfer.currentBlock != transfer.blocks)
+		transfer.currentBlock != transfer.blocks &&
+		!scsiDiskSeekBusy())
 	{
+		waitDataPhase();
+
 		// Take responsibility for waiting for the phase delays
 		uint32_t phaseChangeDelayUs = scsiEnterPhaseImmediate(DATA_IN);
 
@@ -600,7 +1987,7 @@ void scsiDiskPoll()
 		const int buffers = sizeof(scsiDev.data) / SD_SECTOR_SIZE;
 		int prep = 0;
 		int i = 0;
-		int scsiActive __attribute__((unused)) = 0; // unused if DMA disabled
+		int scsiActive = 0;
 		int sdActive = 0;
 
 		// It's highly unlikely that someone is going to use huge transfers
@@ -612,29 +1999,119 @@ void scsiDiskPoll()
 			scsiSetDataCount(totalScsiBytes);
 		}
 
+		ReadStream* stream = &readStreams[scsiDev.target - scsiDev.targets];
+		if (transfer.lba == stream->nextLBA)
+		{
+			stream->sequential++;
+		}
+		else
+		{
+			stream->sequential = 0;
+		}
+		stream->nextLBA = transfer.lba + transfer.blocks;
+
+		int cacheEnabled = scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE;
+		int cacheHit = 0;
+		if (readAhead.sdSectors &&
+			(readAhead.target == scsiDev.target) &&
+			(readAhead.sdLBA == sdLBA) &&
+			(readAhead.sdSectors <= totalSDSectors) &&
+			likely(!useSlowDataCount))
+		{
+			// The first sectors are already on their way. The DMA may
+			// still be in progress.
+			if (readAhead.complete)
+			{
+				prep = readAhead.sdSectors;
+			}
+			else
+			{
+				sdActive = readAhead.sdSectors;
+			}
+			readAhead.sdSectors = 0;
+
+			if (phaseChangeDelayUs > 0)
+			{
+				s2s_delay_us(phaseChangeDelayUs);
+				phaseChangeDelayUs = 0;
+			}
+		}
+		else
+		{
+			cancelReadAhead();
+
+			// Data not yet written must come from the cache, unless the
+			// host wants it from the medium.
+			if (s2s_cacheIsDirty(sdLBA, totalSDSectors) &&
+				(isFUA() || !s2s_cacheContains(sdLBA, totalSDSectors)))
+			{
+				flushWriteBack();
+			}
+
+			cacheHit = cacheEnabled &&
+				!useSlowDataCount &&
+				s2s_cacheContains(sdLBA, totalSDSectors);
+		}
+
+		if (cacheHit)
+		{
+			// Every sector is already in memory. Send it straight to the
+			// FIFO without touching the SD card.
+			s2s_cacheStats.hits++;
+
+			if (phaseChangeDelayUs > 0)
+			{
+				s2s_delay_us(phaseChangeDelayUs);
+				phaseChangeDelayUs = 0;
+			}
+
+			while ((i < totalSDSectors) &&
+				likely(scsiDev.phase == DATA_IN) &&
+				likely(!scsiDev.resetFlag))
+			{
+				scsiWritePIO(
+					s2s_cacheLookup(sdLBA + i),
+					sdSectorBytes(i, sdPerScsi, bytesPerSector));
+				++i;
+			}
+			prep = i;
+		}
+		else if (cacheEnabled)
+		{
+			s2s_cacheStats.misses++;
+		}
+
+		// With FIFO DMA, sector i stays in its buffer until sent while the
+		// SD card fills the following buffers.
+		int fifoDMA = scsiDMAAvailable();
+
+		// Bytes of sector i already sent, and where we'll be once the
+		// current FIFO DMA completes.
+		uint32_t sentBytes = 0;
+		int nextSector = 0;
+		uint32_t nextSentBytes = 0;
+
 		while ((i < totalSDSectors) &&
 			likely(scsiDev.phase == DATA_IN) &&
 			likely(!scsiDev.resetFlag))
 		{
+			if (scsiActive && scsiWriteDMAPoll())
+			{
+				scsiActive = 0;
+				i = nextSector;
+				sentBytes = nextSentBytes;
+			}
+
 			int completedDmaSectors;
 			if (sdActive && (completedDmaSectors = sdReadDMAPoll(sdActive)))
 			{
 				prep += completedDmaSectors;
 				sdActive -= completedDmaSectors;
-			} else if (sdActive > 1)
-			{
-				if ((scsiDev.data[SD_SECTOR_SIZE * (prep % buffers) + 510] != 0xAA) ||
-					(scsiDev.data[SD_SECTOR_SIZE * (prep % buffers) + 511] != 0x33))
-				{
-					prep += 1;
-					sdActive -= 1;
-				}
 			}
 
 			if (!sdActive &&
 				(prep - i < buffers) &&
 				(prep < totalSDSectors) &&
-				((totalSDSectors - prep) >= sdPerScsi) &&
 				(likely(!useSlowDataCount) || scsiPhyComplete()))
 			{
 				// Start an SD transfer if we have space.
@@ -649,25 +2126,23 @@ void scsiDiskPoll()
 
 				if (sectors > 128) sectors = 128; // 65536 DMA limit !!
 
-				// Round-down when we have odd sector sizes.
-				if (sdPerScsi != 1)
+				// The data count must cover whole SCSI sectors. Otherwise
+				// there's no need to round-down, the FIFO is fed by byte.
+				if (unlikely(useSlowDataCount) && (sdPerScsi != 1))
 				{
 					sectors = (sectors / sdPerScsi) * sdPerScsi;
 				}
 
-				for (int dodgy = 0; dodgy < sectors; dodgy++)
+				if (sectors > 0)
 				{
-					scsiDev.data[SD_SECTOR_SIZE * (startBuffer + dodgy) + 510] = 0xAA;
-					scsiDev.data[SD_SECTOR_SIZE * (startBuffer + dodgy) + 511] = 0x33;
-				}
+					sdReadDMA(sdLBA + prep, sectors, &scsiDev.data[SD_SECTOR_SIZE * startBuffer]);
 
-				sdReadDMA(sdLBA + prep, sectors, &scsiDev.data[SD_SECTOR_SIZE * startBuffer]);
+					sdActive = sectors;
 
-				sdActive = sectors;
-
-				if (useSlowDataCount)
-				{
-					scsiSetDataCount((sectors / sdPerScsi) * bytesPerSector);
+					if (useSlowDataCount)
+					{
+						scsiSetDataCount((sectors / sdPerScsi) * bytesPerSector);
+					}
 				}
 
 				// Wait now that the SD card is busy
@@ -681,19 +2156,85 @@ void scsiDiskPoll()
 				}
 			}
 
-			if ((prep - i) > 0)
+			if (!scsiActive && (prep - i) > 0)
 			{
-				int dmaBytes = SD_SECTOR_SIZE;
-				if ((i % sdPerScsi) == (sdPerScsi - 1))
+				// Gather up to a FIFO's worth of valid bytes from the
+				// buffered SD sectors, skipping the unused end of partial
+				// sectors. Hold back a partial FIFO chunk until the last
+				// sector is buffered so the FIFO is always filled.
+				ScsiFifoSegment segs[SCSI_DMA_MAX_SEGMENTS];
+				int segCount = 0;
+				uint32_t bytes = 0;
+				int k = i;
+				int end = prep < totalSDSectors ? prep : totalSDSectors;
+				uint32_t offset = sentBytes;
+				while ((k < end) &&
+					(bytes < SCSI_FIFO_DEPTH) &&
+					(segCount < sizeof(segs) / sizeof(segs[0])))
+				{
+					uint32_t sectorBytes =
+						sdSectorBytes(k, sdPerScsi, bytesPerSector);
+					uint32_t count = sectorBytes - offset;
+					if (count > SCSI_FIFO_DEPTH - bytes)
+					{
+						count = SCSI_FIFO_DEPTH - bytes;
+					}
+
+					segs[segCount].data =
+						&scsiDev.data[SD_SECTOR_SIZE * (k % buffers) + offset];
+					segs[segCount].count = count;
+					++segCount;
+
+					bytes += count;
+					offset += count;
+					if (offset == sectorBytes)
+					{
+						++k;
+						offset = 0;
+					}
+				}
+
+				if ((bytes == SCSI_FIFO_DEPTH) ||
+					(k == totalSDSectors) ||
+					unlikely(useSlowDataCount))
 				{
-					dmaBytes = bytesPerSector % SD_SECTOR_SIZE;
-					if (dmaBytes == 0) dmaBytes = SD_SECTOR_SIZE;
+					if (fifoDMA)
+					{
+						scsiWriteGatherDMA(segs, segCount);
+						scsiActive = 1;
+						nextSector = k;
+						nextSentBytes = offset;
+					}
+					else
+					{
+						scsiWriteGatherPIO(segs, segCount);
+						i = k;
+						sentBytes = offset;
+					}
 				}
+			}
+		}
 
-				uint8_t* scsiDmaData = &(scsiDev.data[SD_SECTOR_SIZE * (i % buffers)]);
-				scsiWritePIO(scsiDmaData, dmaBytes);
+		while (scsiActive && !scsiWriteDMAPoll())
+		{
+			// Only reached if the loop exited early. Don't leave the DMA
+			// reading from a buffer we're about to reuse.
+		}
 
-				++i;
+		if (cacheEnabled &&
+			!cacheHit &&
+			(i == totalSDSectors) &&
+			(totalSDSectors <= S2S_CACHE_MAX_INSERT) &&
+			likely(scsiDev.phase == DATA_IN) &&
+			likely(!scsiDev.resetFlag))
+		{
+			// Small reads are likely to be filesystem metadata that will be
+			// read again soon. The data is still in our buffers.
+			for (int j = 0; j < totalSDSectors; ++j)
+			{
+				s2s_cacheInsert(
+					sdLBA + j,
+					&scsiDev.data[SD_SECTOR_SIZE * (j % buffers)]);
 			}
 		}
 
@@ -718,11 +2259,21 @@ void scsiDiskPoll()
 		{
 			scsiDev.phase = STATUS;
 		}
+		uint32_t nextLBA = transfer.lba + transfer.blocks;
 		scsiDiskReset();
+
+		if ((i == totalSDSectors) &&
+			(scsiDev.status == GOOD) &&
+			likely(!scsiDev.resetFlag))
+		{
+			startReadAhead(nextLBA, totalSDSectors);
+		}
 	}
 	else if (scsiDev.phase == DATA_OUT &&
-		transfer.currentBlock != transfer.blocks)
+		transfer.currentBlock != transfer.blocks &&
+		!scsiDiskSeekBusy())
 	{
+		waitDataPhase();
 		scsiEnterPhase(DATA_OUT);
 
 		const int sdPerScsi = SDSectorsPerSCSISector(bytesPerSector);
@@ -735,6 +2286,29 @@ void scsiDiskPoll()
 		int i = 0;
 		int clearBSY = 0;
 
+		if (transfer.verify == VERIFY_ONLY)
+		{
+			// Compare against the newest data.
+			if (s2s_cacheIsDirty(sdLBA, totalSDSectors))
+			{
+				flushWriteBack();
+			}
+		}
+		else
+		{
+			// Any cached copy is about to become stale.
+			s2s_cacheInvalidate(sdLBA, totalSDSectors);
+		}
+		int verifyOk = 1;
+
+		// Small writes are acknowledged once they're in the cache.
+		int useWriteBack =
+			(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE) &&
+			scsiDev.target->liveCfg.writeCache &&
+			(totalSDSectors <= S2S_CACHE_MAX_INSERT) &&
+			(transfer.verify == VERIFY_NONE) &&
+			!isFUA();
+
 		int parityError = 0;
 		int enableParity = scsiDev.boardCfg.flags & S2S_CFG_ENABLE_PARITY;
 
@@ -749,9 +2323,9 @@ void scsiDiskPoll()
 		// to 768kb
 		uint32_t totalTransferBytes = transfer.blocks * bytesPerSector;
 		int useSlowDataCount = totalTransferBytes >= SCSI_XFER_MAX;
+		uint32_t scsiStartCycles = DWT->CYCCNT;
 		if (!useSlowDataCount)
 		{
-			DWT->CYCCNT = 0; // Start counting cycles
 			scsiSetDataCount(totalTransferBytes);
 		}
 
@@ -764,7 +2338,9 @@ void scsiDiskPoll()
 			uint32_t rem = totalSDSectors - i;
 			uint32_t sectors = rem < maxSectors ? rem : maxSectors;
 
-			if (bytesPerSector == SD_SECTOR_SIZE)
+			if ((bytesPerSector == SD_SECTOR_SIZE) &&
+				!useWriteBack &&
+				(transfer.verify == VERIFY_NONE))
 			{
 				// We assume the SD card is faster than the SCSI interface, but has
 				// no flow control. This can be handled if a) the scsi interface
@@ -772,15 +2348,16 @@ void scsiDiskPoll()
 				// the SD interface cannot catch up.
 				uint32_t totalBytes = sectors * SD_SECTOR_SIZE;
 
-				uint32_t sdSpeedKBs = s2s_getSdRateKBs() + (scsiDev.sdUnderrunCount * 256);
+				HostSpeed* host = getHostSpeed();
+				uint32_t sdSpeedKBs = s2s_getSdRateKBs() + (host->underrunCount * 256);
 				uint32_t readAheadBytes = calcReadahead(
 					totalBytes,
 					sdSpeedKBs,
-					scsiDev.hostSpeedKBs);
+					host);
 
 				if (useSlowDataCount)
 				{
-					DWT->CYCCNT = 0; // Start counting cycles
+					scsiStartCycles = DWT->CYCCNT;
 					scsiSetDataCount(totalBytes);
 				}
 
@@ -795,16 +2372,13 @@ void scsiDiskPoll()
 
 					if (i == 0 && !useSlowDataCount)
 					{
-						uint32_t elapsedCycles = DWT->CYCCNT;
+						uint32_t rateKBs = calcRateKBs(
+							readAheadBytes, DWT->CYCCNT - scsiStartCycles);
 
-						// uint32_t rateKBs = (readAheadBytes / 1000) / (elapsedCycles / HAL_RCC_GetHCLKFreq());
-						// Scaled by 4 to avoid overflow w/ max 65536 at 108MHz.
-						uint32_t rateKBs = ((readAheadBytes / 4) * (HAL_RCC_GetHCLKFreq() / 1000) / elapsedCycles) * 4;
+						uint32_t estimateKBs = host->speedKBs;
+						addHostSpeedSample(host, rateKBs);
 
-						scsiDev.hostSpeedKBs = (scsiDev.hostSpeedKBs + rateKBs) / 2;
-						scsiDev.hostSpeedMeasured = 1;
-
-						if (rateKBs < scsiDev.hostSpeedKBs)
+						if (rateKBs < estimateKBs)
 						{
 							// Our readahead was too slow; assume remaining bytes
 							// will be as well.
@@ -813,7 +2387,7 @@ void scsiDiskPoll()
 								uint32_t properReadahead = calcReadahead(
 									totalBytes,
 									sdSpeedKBs,
-									rateKBs);
+									host); // Now rateKBs
 
 								if (properReadahead > readAheadBytes)
 								{
@@ -830,6 +2404,11 @@ void scsiDiskPoll()
 					}
 				}
 
+				// With everything buffered the SD card alone sets the pace.
+				int measureSd = scsiBytesRead == totalBytes;
+				uint32_t sdStartCycles = DWT->CYCCNT;
+
+				s2s_traceSdStart();
 				HAL_SD_WriteBlocks_DMA(&hsd, (&scsiDev.data[0]), i + sdLBA, sectors);
 
 				int underrun = 0;
@@ -853,6 +2432,12 @@ void scsiDiskPoll()
 					// Wait while keeping BSY.
 				}
 
+				if (measureSd && (HAL_SD_GetState(&hsd) != HAL_SD_STATE_BUSY))
+				{
+					s2s_addSdRateSample(
+						calcRateKBs(totalBytes, DWT->CYCCNT - sdStartCycles));
+				}
+
 				if (i + sectors >= totalSDSectors &&
 					!underrun &&
 					(!parityError || !enableParity))
@@ -873,44 +2458,121 @@ void scsiDiskPoll()
 					// Wait while keeping BSY.
 				}
 				HAL_SD_GetCardState(&hsd); // TODO check error response
+				s2s_traceSdDone();
 
 				if (underrun && (!parityError || !enableParity))
 				{
 					// Try again. Data is still in memory.
 					BSP_SD_WriteBlocks_DMA(&scsiDev.data[0], i + sdLBA, sectors);
-					scsiDev.sdUnderrunCount++;
+					if (host->underrunCount < 255)
+					{
+						host->underrunCount++;
+					}
+					host->underrunTime = s2s_getTime_ms();
 				}
 
 				i += sectors;
 			}
 			else
 			{
-				// Well, until we have some proper non-blocking SD code, we must
-				// do this in a half-duplex fashion. We need to write as much as
-				// possible in each SD card transaction.
+				// Ping-pong between the two halves of the buffer. The next
+				// batch is read from SCSI while the previous batch is written
+				// to the SD card. Batches hold whole SCSI sectors so the data
+				// count is correct when set per batch.
 				// use sg_dd from sg_utils3 tools to test.
-
-				if (useSlowDataCount)
+				const uint32_t halfSectors = maxSectors / 2;
+				const uint32_t batchMax = halfSectors - (halfSectors % sdPerScsi);
+				uint8_t* buf = &scsiDev.data[0];
+				int sdActive = 0;
+				int fifoDMA = scsiDMAAvailable();
+
+				while ((i < totalSDSectors) &&
+					likely(scsiDev.phase == DATA_OUT) &&
+					likely(!scsiDev.resetFlag))
 				{
-					scsiSetDataCount(sectors * bytesPerSector);
-				}
+					rem = totalSDSectors - i;
+					sectors = rem < batchMax ? rem : batchMax;
 
-				for (int scsiSector = i; scsiSector < i + sectors; ++scsiSector)
-				{
-					int dmaBytes = SD_SECTOR_SIZE;
-					if ((scsiSector % sdPerScsi) == (sdPerScsi - 1))
+					if (useSlowDataCount)
+					{
+						scsiSetDataCount((sectors / sdPerScsi) * bytesPerSector);
+					}
+
+					for (int scsiSector = i; scsiSector < i + sectors; ++scsiSector)
+					{
+						int dmaBytes = SD_SECTOR_SIZE;
+						if ((scsiSector % sdPerScsi) == (sdPerScsi - 1))
+						{
+							dmaBytes = bytesPerSector % SD_SECTOR_SIZE;
+							if (dmaBytes == 0) dmaBytes = SD_SECTOR_SIZE;
+						}
+
+						uint8_t* sector = &buf[SD_SECTOR_SIZE * (scsiSector - i)];
+						if (fifoDMA)
+						{
+							// Check on the SD card write of the previous
+							// batch while the FIFO DMA runs.
+							scsiReadDMA(sector, dmaBytes);
+							while (!scsiReadDMAPoll(&parityError))
+							{
+								if (sdActive && sdWriteDone())
+								{
+									sdActive = 0;
+								}
+							}
+						}
+						else
+						{
+							scsiReadPIO(sector, dmaBytes, &parityError);
+						}
+					}
+
+					if (sdActive)
+					{
+						waitSDWrite();
+						sdActive = 0;
+					}
+
+					if (parityError && enableParity)
+					{
+						// Don't write bad data. Keep reading to leave the
+						// FIFOs in a good state.
+					}
+					else if (useWriteBack)
+					{
+						writeBackSectors(i + sdLBA, sectors, buf);
+					}
+					else if (transfer.verify == VERIFY_NONE)
+					{
+						s2s_traceSdStart();
+						HAL_SD_WriteBlocks_DMA(&hsd, buf, i + sdLBA, sectors);
+						sdActive = 1;
+					}
+					else
 					{
-						dmaBytes = bytesPerSector % SD_SECTOR_SIZE;
-						if (dmaBytes == 0) dmaBytes = SD_SECTOR_SIZE;
+						if (transfer.verify == VERIFY_AFTER_WRITE)
+						{
+							s2s_traceSdStart();
+							HAL_SD_WriteBlocks_DMA(&hsd, buf, i + sdLBA, sectors);
+							waitSDWrite();
+						}
+
+						// Only the first miscompare is reported.
+						verifyOk = verifyOk &&
+							compareSectors(
+								i + sdLBA, i, sectors, buf, sdPerScsi, bytesPerSector);
 					}
+					i += sectors;
 
-					scsiReadPIO(&scsiDev.data[SD_SECTOR_SIZE * (scsiSector - i)], dmaBytes, &parityError);
+					buf = (buf == &scsiDev.data[0]) ?
+						&scsiDev.data[halfSectors * SD_SECTOR_SIZE] :
+						&scsiDev.data[0];
 				}
-				if (!parityError || !enableParity)
+
+				if (sdActive)
 				{
-					BSP_SD_WriteBlocks_DMA(&scsiDev.data[0], i + sdLBA, sectors);
+					waitSDWrite();
 				}
-				i += sectors;
 			}
 		}
 
@@ -933,14 +2595,36 @@ void scsiDiskPoll()
 			if (parityError &&
 				(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_PARITY))
 			{
-				scsiDev.target->sense.code = ABORTED_COMMAND;
-				scsiDev.target->sense.asc = SCSI_PARITY_ERROR;
+				scsiDev.target->sense->code = ABORTED_COMMAND;
+				scsiDev.target->sense->asc = SCSI_PARITY_ERROR;
 				scsiDev.status = CHECK_CONDITION;;
 			}
+			// compareSectors already set the sense data on failure.
 			scsiDev.phase = STATUS;
 		}
 		scsiDiskReset();
 	}
+	else if (preFetch.dmaActive)
+	{
+		pollPreFetch();
+	}
+	else if (fill.busy)
+	{
+		pollFill();
+	}
+	else if (readAheadIdle())
+	{
+		// Written data takes priority over PRE-FETCH, then FORMAT UNIT.
+		pollWriteBack();
+		if (!writeBack.dmaActive && preFetch.sdSectors)
+		{
+			pollPreFetch();
+		}
+		if (!writeBack.dmaActive && !preFetch.dmaActive && fill.target)
+		{
+			pollFill();
+		}
+	}
 }
 
 void scsiDiskReset()
@@ -951,6 +2635,11 @@ void scsiDiskReset()
 	// transfer.lba = 0; // Needed in Request Sense to determine failure
 	transfer.blocks = 0;
 	transfer.currentBlock = 0;
+	transfer.verify = VERIFY_NONE;
+
+	cancelReadAhead();
+	waitPreFetch();
+	waitWriteBack();
 
 	// Cancel long running commands!
 #if 0
@@ -969,6 +2658,8 @@ void scsiDiskReset()
 void scsiDiskInit()
 {
 	scsiDiskReset();
+	s2s_cacheInit();
+	memset(seekDelays, 0, sizeof(seekDelays));
 
 	// Don't require the host to send us a START STOP UNIT command
 	blockDev.state = DISK_STARTED;
@@ -36,9 +36,17 @@ typedef struct
 	int state;
 } BlockDevice;
 
+typedef enum
+{
+	VERIFY_NONE,
+	VERIFY_AFTER_WRITE, // WRITE AND VERIFY. Read back and compare.
+	VERIFY_ONLY // VERIFY with BYTCHK. Compare without writing.
+} TRANSFER_VERIFY;
+
 typedef struct
 {
 	int multiBlock; // True if we're using a multi-block SPI transfer.
+	int verify; // TRANSFER_VERIFY
 	uint32_t lba;
 	uint32_t blocks;
 
@@ -53,4 +61,31 @@ void scsiDiskReset(void);
 void scsiDiskPoll(void);
 int scsiDiskCommand(void);
 
+// Sets NOT READY status and returns 0 unless the medium can be accessed.
+int scsiDiskTestUnitReady(void);
+
+// Called once a new CDB has been received, before the command is processed.
+void scsiDiskCheckReadAhead(void);
+
+// Non-zero while the current target is emulating a slow seek. The data
+// and status phases must wait until it returns 0.
+int scsiDiskSeekBusy(void);
+
+// Non-zero while a FORMAT UNIT for the current target is still filling the
+// SD card. progress, if not NULL, is set to the fraction done out of 65536.
+int scsiDiskFormatBusy(uint16_t* progress);
+
+// Zero blocks logical blocks from lba, or all blocks from lba to the end of
+// the medium if toEnd is set. Whole SD erase groups are erased.
+// If immed is set, GOOD status is returned straight away and the erase
+// runs in the background, the same as FORMAT UNIT.
+void scsiDiskErase(uint32_t lba, uint32_t blocks, int toEnd, int immed);
+
+// Non-zero if there's no background SD card work for scsiDiskPoll to do.
+int scsiDiskIdle(void);
+
+// Stop any background SD card activity. Must be called before accessing the
+// SD card outside of the SCSI command handlers.
+void scsiDiskQuiesce(void);
+
 #endif
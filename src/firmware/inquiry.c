@@ -98,8 +98,8 @@ void s2s_scsiInquiry()
 		{
 			// error.
 			scsiDev.status = CHECK_CONDITION;
-			scsiDev.target->sense.code = ILLEGAL_REQUEST;
-			scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+			scsiDev.target->sense->code = ILLEGAL_REQUEST;
+			scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 			scsiDev.phase = STATUS;
 		}
 		else
@@ -149,8 +149,8 @@ void s2s_scsiInquiry()
 	{
 		// error.
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		scsiDev.phase = STATUS;
 	}
 
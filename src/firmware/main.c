@@ -95,6 +95,23 @@ void mainInit()
 	lastSDPoll = s2s_getTime_ms();
 }
 
+static int isUsbIdle()
+{
+#ifdef S2S_USB_FS
+	if (!s2s_usbDeviceIdle(&hUsbDeviceFS))
+	{
+		return 0;
+	}
+#endif
+#ifdef S2S_USB_HS
+	if (!s2s_usbDeviceIdle(&hUsbDeviceHS))
+	{
+		return 0;
+	}
+#endif
+	return 1;
+}
+
 void mainLoop()
 {
 	scsiDev.watchdogTick++;
@@ -117,8 +134,9 @@ void mainLoop()
     // TODO test if USB transfer is in progress
 	if (unlikely(scsiDev.phase == BUS_FREE))
 	{
-		if (unlikely(s2s_elapsedTime_ms(lastSDPoll) > 200))
+		if (unlikely(sdCardChanged || (s2s_elapsedTime_ms(lastSDPoll) > 200)))
 		{
+			sdCardChanged = 0;
 			lastSDPoll = s2s_getTime_ms();
 			if (sdInit())
 			{
@@ -139,26 +157,32 @@ void mainLoop()
 		}
 		else
 		{
-			// TODO this hurts performance significantly! Work out why __WFI()
-			// doesn't wake up immediately !
-#if 0
-			// Wait for our 1ms timer to save some power.
-			// There's an interrupt on the SEL signal to ensure we respond
-			// quickly to any SCSI commands. The selection abort time is
-			// only 250us, and new SCSI-3 controllers time-out very
-			// not long after that, so we need to ensure we wake up quickly.
+			// Sleep until the next interrupt if there's nothing to poll.
+			// SEL and RST interrupt via EXTI4, so we still wake well within
+			// the 250us selection abort time. Card detect interrupts via
+			// EXTI9_5. USB, DMA and the 1ms SysTick wake us for everything
+			// else.
+			// Background SD card work needs polling, so don't sleep then.
+			int slept = 0;
 			uint32_t interruptState = __get_PRIMASK();
 			__disable_irq();
-
-			if (!*SCSI_STS_SELECTED)
+			if (!scsiDev.selFlag &&
+				!*SCSI_STS_SELECTED &&
+				!scsiDev.resetFlag &&
+				!sdCardChanged &&
+				scsiDiskIdle() &&
+				isUsbIdle())
 			{
-				//__WFI(); // Will wake on interrupt, regardless of mask
+				__WFI(); // Will wake on interrupt, regardless of mask
+				slept = 1;
 			}
 			if (!interruptState)
 			{
 				__enable_irq();
 			}
-#endif
+
+			// Measure the wake up time for this selection
+			scsiDev.selWake = slept && scsiDev.selFlag;
 		}
 	}
 	else if ((scsiDev.phase >= 0) && (blockDev.state & DISK_PRESENT))
@@ -17,6 +17,7 @@
 
 #include "scsi.h"
 #include "config.h"
+#include "disk.h"
 #include "mo.h"
 
 
@@ -29,7 +30,41 @@ int scsiMOCommand()
 	if ((command == 0x2C) || // ERASE(10)
 		(command == 0xAC)) // ERASE(12)
 	{
-		// TODO consider sending an erase command to the SD card.
+		// Erase the SD card too, so it knows the blocks are free.
+		int era = scsiDev.cdb[1] & 0x04; // Erase to the end of the medium.
+		int immed = scsiDev.cdb[1] & 0x02;
+		uint32_t lba =
+			(((uint32_t) scsiDev.cdb[2]) << 24) +
+			(((uint32_t) scsiDev.cdb[3]) << 16) +
+			(((uint32_t) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32_t blocks;
+		if (command == 0x2C)
+		{
+			blocks =
+				(((uint32_t) scsiDev.cdb[7]) << 8) +
+				scsiDev.cdb[8];
+		}
+		else
+		{
+			blocks =
+				(((uint32_t) scsiDev.cdb[6]) << 24) +
+				(((uint32_t) scsiDev.cdb[7]) << 16) +
+				(((uint32_t) scsiDev.cdb[8]) << 8) +
+				scsiDev.cdb[9];
+		}
+
+		if (era && blocks)
+		{
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense->code = ILLEGAL_REQUEST;
+			scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
+			scsiDev.phase = STATUS;
+		}
+		else
+		{
+			scsiDiskErase(lba, blocks, era, immed);
+		}
 
 		commandHandled = 1;
 	}
@@ -21,6 +21,7 @@
 #include "mode.h"
 #include "disk.h"
 #include "inquiry.h"
+#include "cache.h"
 
 #include <string.h>
 
@@ -185,13 +186,18 @@ static const uint8_t RigidDiskDriveGeometry_SCSI1[] =
 static const uint8_t CachingPage[] =
 {
 0x08, // Page Code
-0x0A, // Page length
+0x12, // Page length
 0x01, // Read cache disable
 0x00, // No useful rention policy.
 0x00, 0x00, // Pre-fetch always disabled
 0x00, 0x00, // Minimum pre-fetch
 0x00, 0x00, // Maximum pre-fetch
 0x00, 0x00, // Maximum pre-fetch ceiling
+0x00, // No force sequential write, non-volatile cache, etc
+0x00, // Number of cache segments
+0x00, 0x00, // Cache segment size
+0x00, // Reserved
+0x00, 0x00, 0x00 // Non cache segment size
 };
 
 // Old CCS SCSI-1 cache page
@@ -274,9 +280,9 @@ static void doModeSense(
 	case S2S_CFG_FIXED:
 	case S2S_CFG_REMOVEABLE:
 		mediumType = 0; // We should support various floppy types here!
-		// Contains cache bits (0) and a Write-Protect bit.
+		// Contains cache bits (DPOFUA, we honour FUA) and a Write-Protect bit.
 		deviceSpecificParam =
-			(blockDev.state & DISK_WP) ? 0x80 : 0;
+			((blockDev.state & DISK_WP) ? 0x80 : 0) | 0x10;
 		density = 0; // reserved for direct access
 		break;
 
@@ -486,6 +492,31 @@ static void doModeSense(
 	{
 		pageFound = 1;
 		pageIn(pc, idx, CachingPage, sizeof(CachingPage));
+
+		if ((pc == 0x01) &&
+			(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE))
+		{
+			scsiDev.data[idx+2] = 0x04; // WCE is changeable
+		}
+		else if (scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE)
+		{
+			// Each cache segment holds a single SD sector.
+			uint32_t cacheBlocks = S2S_CACHE_SECTORS /
+				SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
+
+			scsiDev.data[idx+2] = 0x00; // Read cache enabled
+			if ((pc == 0x00) && scsiDev.target->liveCfg.writeCache)
+			{
+				scsiDev.data[idx+2] |= 0x04; // Write cache enabled
+			}
+			scsiDev.data[idx+8] = cacheBlocks >> 8; // Maximum pre-fetch
+			scsiDev.data[idx+9] = cacheBlocks;
+			scsiDev.data[idx+10] = cacheBlocks >> 8; // Maximum pre-fetch ceiling
+			scsiDev.data[idx+11] = cacheBlocks;
+			scsiDev.data[idx+13] = S2S_CACHE_SECTORS;
+			scsiDev.data[idx+14] = SD_SECTOR_SIZE >> 8;
+			scsiDev.data[idx+15] = SD_SECTOR_SIZE & 0xFF;
+		}
 		idx += sizeof(CachingPage);
 	}
 
@@ -547,8 +578,8 @@ static void doModeSense(
 		// Unknown Page Code
 		pageFound = 0;
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		scsiDev.phase = STATUS;
 	}
 	else
@@ -647,6 +678,21 @@ static void doModeSelect(void)
 				}
 			}
 			break;
+			case 0x08: // Caching Page
+			{
+				if (pageLen < 1) goto bad;
+
+				int wce = scsiDev.data[idx+2] & 0x04;
+				if (wce && !(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE))
+				{
+					goto bad;
+				}
+
+				// Any cached writes continue to drain in the background
+				// once the cache is disabled.
+				scsiDev.target->liveCfg.writeCache = wce ? 1 : 0;
+			}
+			break;
 			//default:
 
 				// Easiest to just ignore for now. We'll get here when changing
@@ -659,8 +705,8 @@ static void doModeSelect(void)
 	goto out;
 bad:
 	scsiDev.status = CHECK_CONDITION;
-	scsiDev.target->sense.code = ILLEGAL_REQUEST;
-	scsiDev.target->sense.asc = INVALID_FIELD_IN_PARAMETER_LIST;
+	scsiDev.target->sense->code = ILLEGAL_REQUEST;
+	scsiDev.target->sense->asc = INVALID_FIELD_IN_PARAMETER_LIST;
 
 out:
 	scsiDev.phase = STATUS;
@@ -0,0 +1,104 @@
+//	Copyright (C) 2026 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "config.h"
+#include "opcodes.h"
+
+// Commands common to all device types.
+// INQUIRY, REQUEST SENSE, RESERVE and RELEASE are handled before the medium
+// state is checked.
+#define SCSI_OPCODES \
+	[0x03] = S2S_OP_SCSI | S2S_OP_ANY_STATE, /* REQUEST SENSE */ \
+	[0x12] = S2S_OP_SCSI | S2S_OP_ANY_STATE, /* INQUIRY */ \
+	[0x16] = S2S_OP_SCSI | S2S_OP_ANY_STATE, /* RESERVE */ \
+	[0x17] = S2S_OP_SCSI | S2S_OP_ANY_STATE, /* RELEASE */ \
+	[0xA3] = S2S_OP_SCSI | S2S_OP_ANY_STATE, /* REPORT SUPPORTED OPERATION CODES */ \
+	\
+	[0x00] = S2S_OP_DISK | S2S_OP_ANY_STATE, /* TEST UNIT READY */ \
+	[0x01] = S2S_OP_DISK, /* REZERO UNIT */ \
+	[0x04] = S2S_OP_DISK, /* FORMAT UNIT */ \
+	[0x08] = S2S_OP_DISK, /* READ(6) */ \
+	[0x0A] = S2S_OP_DISK, /* WRITE(6) */ \
+	[0x0B] = S2S_OP_DISK, /* SEEK(6) */ \
+	[0x1B] = S2S_OP_DISK | S2S_OP_ANY_STATE, /* START STOP UNIT */ \
+	[0x1E] = S2S_OP_DISK, /* PREVENT ALLOW MEDIUM REMOVAL */ \
+	[0x25] = S2S_OP_DISK, /* READ CAPACITY(10) */ \
+	[0x28] = S2S_OP_DISK, /* READ(10) */ \
+	[0x2A] = S2S_OP_DISK, /* WRITE(10) */ \
+	[0x2B] = S2S_OP_DISK, /* SEEK(10) */ \
+	[0x2E] = S2S_OP_DISK, /* WRITE AND VERIFY(10) */ \
+	[0x2F] = S2S_OP_DISK, /* VERIFY(10) */ \
+	[0x34] = S2S_OP_DISK, /* PRE-FETCH(10) */ \
+	[0x35] = S2S_OP_DISK, /* SYNCHRONIZE CACHE(10) */ \
+	[0x36] = S2S_OP_DISK, /* LOCK UNLOCK CACHE(10) */ \
+	[0x37] = S2S_OP_DISK, /* READ DEFECT DATA(10) */ \
+	[0x41] = S2S_OP_DISK, /* WRITE SAME(10) */ \
+	[0x88] = S2S_OP_DISK, /* READ(16) */ \
+	[0x8A] = S2S_OP_DISK, /* WRITE(16) */ \
+	[0x8E] = S2S_OP_DISK, /* WRITE AND VERIFY(16) */ \
+	[0x91] = S2S_OP_DISK, /* SYNCHRONIZE CACHE(16) */ \
+	[0x9E] = S2S_OP_DISK, /* READ CAPACITY(16) */ \
+	[0xA8] = S2S_OP_DISK, /* READ(12) */ \
+	[0xAA] = S2S_OP_DISK, /* WRITE(12) */ \
+	[0xAE] = S2S_OP_DISK, /* WRITE AND VERIFY(12) */ \
+	\
+	[0x15] = S2S_OP_MODE, /* MODE SELECT(6) */ \
+	[0x1A] = S2S_OP_MODE, /* MODE SENSE(6) */ \
+	[0x55] = S2S_OP_MODE, /* MODE SELECT(10) */ \
+	[0x5A] = S2S_OP_MODE, /* MODE SENSE(10) */ \
+	\
+	[0x0F] = S2S_OP_DIAG, /* XEBEC WRITE SECTOR BUFFER */ \
+	[0x1C] = S2S_OP_DIAG, /* RECEIVE DIAGNOSTIC RESULTS */ \
+	[0x1D] = S2S_OP_DIAG, /* SEND DIAGNOSTIC */ \
+	[0x3B] = S2S_OP_DIAG, /* WRITE BUFFER */ \
+	[0x3C] = S2S_OP_DIAG, /* READ BUFFER */ \
+	\
+	[0xC0] = S2S_OP_VENDOR, /* OMTI DEFINE FLEXIBLE DISK FORMAT */ \
+	[0xC2] = S2S_OP_VENDOR /* OMTI ASSIGN DISK PARAMETERS */
+
+static const uint8_t DiskOpcodes[256] =
+{
+	SCSI_OPCODES
+};
+
+static const uint8_t OpticalOpcodes[256] =
+{
+	SCSI_OPCODES,
+	[0x43] = S2S_OP_CDROM | S2S_OP_ANY_STATE, /* READ TOC */
+	[0x44] = S2S_OP_CDROM | S2S_OP_ANY_STATE /* READ HEADER */
+};
+
+static const uint8_t MOOpcodes[256] =
+{
+	SCSI_OPCODES,
+	[0x2C] = S2S_OP_MO, /* ERASE(10) */
+	[0xAC] = S2S_OP_MO /* ERASE(12) */
+};
+
+const uint8_t* s2s_getOpcodeTable(uint8_t deviceType)
+{
+	switch (deviceType)
+	{
+	case S2S_CFG_OPTICAL: return OpticalOpcodes;
+	case S2S_CFG_MO: return MOOpcodes;
+
+	// Tape commands aren't implemented yet. Sequential devices use the
+	// direct-access commands for now.
+	default: return DiskOpcodes;
+	}
+}
@@ -0,0 +1,44 @@
+//	Copyright (C) 2026 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef S2S_OPCODES_H
+#define S2S_OPCODES_H
+
+#include <stdint.h>
+
+// Module that handles each opcode. Low bits of an opcode table entry.
+typedef enum
+{
+	S2S_OP_UNSUPPORTED = 0,
+	S2S_OP_SCSI, // scsi.c
+	S2S_OP_DISK, // disk.c
+	S2S_OP_MODE, // mode.c
+	S2S_OP_DIAG, // diagnostic.c
+	S2S_OP_CDROM, // cdrom.c
+	S2S_OP_MO, // mo.c
+	S2S_OP_VENDOR, // vendor.c
+
+	S2S_OP_HANDLER_MASK = 0x0F,
+
+	// May be used before the medium is ready.
+	S2S_OP_ANY_STATE = 0x80
+} S2S_OP_FLAGS;
+
+// Returns the 256 entry opcode table for a S2S_CFG_TYPE device type.
+const uint8_t* s2s_getOpcodeTable(uint8_t deviceType);
+
+#endif
@@ -15,6 +15,13 @@
 //	You should have received a copy of the GNU General Public License
 //	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
 
+#ifdef STM32F2xx
+#include "stm32f2xx.h"
+#endif
+#ifdef STM32F4xx
+#include "stm32f4xx.h"
+#endif
+
 #include "scsi.h"
 #include "scsiPhy.h"
 #include "config.h"
@@ -30,6 +37,8 @@
 #include "tape.h"
 #include "mo.h"
 #include "vendor.h"
+#include "opcodes.h"
+#include "trace.h"
 
 #include <string.h>
 
@@ -46,6 +55,24 @@ static void process_DataOut(void);
 static void process_Command(void);
 
 static void doReserveRelease(void);
+static int doScsiCommand(void);
+static int doDiagnosticCommand(void);
+
+// Indexed by S2S_OP_FLAGS handler. Each returns 0 if it didn't handle the
+// command after all.
+static int (*const OpcodeHandlers[])(void) =
+{
+	[S2S_OP_SCSI] = doScsiCommand,
+	[S2S_OP_DISK] = scsiDiskCommand,
+	[S2S_OP_MODE] = scsiModeCommand,
+	[S2S_OP_DIAG] = doDiagnosticCommand,
+	[S2S_OP_CDROM] = scsiCDRomCommand,
+	[S2S_OP_MO] = scsiMOCommand,
+	[S2S_OP_VENDOR] = scsiVendorCommand
+};
+
+// Bus settle delay + bus clear delay = 1200ns, rounded up.
+#define BUS_SETTLE_CYCLES (2 * (s2s_cpu_freq / 1000000))
 
 void enter_BusFree()
 {
@@ -119,6 +146,65 @@ int process_MessageIn(int releaseBusFree)
 	}
 }
 
+// Fast path for the usual end of a command, once GOOD or CHECK CONDITION
+// status has been sent. COMMAND COMPLETE is sent and the bus released
+// without waiting for another scsiPoll.
+static void process_CommandComplete()
+{
+	scsiDev.atnFlag |= scsiStatusATN();
+	if (unlikely(scsiDev.atnFlag))
+	{
+		// Handle the MESSAGE OUT on the next poll.
+		return;
+	}
+
+	scsiEnterPhase(MESSAGE_IN);
+	scsiWriteByte(MSG_COMMAND_COMPLETE);
+
+	if (scsiDev.compatMode < COMPAT_SCSI2)
+	{
+		// Keep all the delays for older hosts.
+		enter_BusFree();
+		return;
+	}
+
+	scsiDev.busFreeCycles = DWT->CYCCNT;
+	scsiDev.busSettling = 1;
+	scsiEnterBusFree();
+	s2s_ledOff();
+	scsiDev.phase = BUS_FREE;
+	scsiDev.selFlag = 0;
+
+	// Don't wait for the initiator to stop driving signals. The main loop
+	// gets on with SD card work, and scsiPoll ignores the bus until
+	// busSettled says the delay has passed.
+}
+
+// Returns non-zero once the bus settle and bus clear delays have passed
+// since process_CommandComplete released BSY.
+static int busSettled()
+{
+	if (likely(!scsiDev.busSettling))
+	{
+		return 1;
+	}
+	else if (DWT->CYCCNT - scsiDev.busFreeCycles < BUS_SETTLE_CYCLES)
+	{
+		return 0;
+	}
+
+	scsiDev.busSettling = 0;
+
+	// Ignore a SEL from the last nexus that was seen before the bus was
+	// clear.
+	if (scsiDev.selFlag &&
+		(scsiDev.selCycles - scsiDev.busFreeCycles < BUS_SETTLE_CYCLES))
+	{
+		scsiDev.selFlag = 0;
+	}
+	return 1;
+}
+
 static void messageReject()
 {
 	scsiEnterPhase(MESSAGE_IN);
@@ -131,8 +217,8 @@ static void enter_Status(uint8_t status)
 	scsiDev.phase = STATUS;
 
 	scsiDev.lastStatus = scsiDev.status;
-	scsiDev.lastSense = scsiDev.target->sense.code;
-	scsiDev.lastSenseASC = scsiDev.target->sense.asc;
+	scsiDev.lastSense = scsiDev.target->sense->code;
+	scsiDev.lastSenseASC = scsiDev.target->sense->asc;
 }
 
 void process_Status()
@@ -199,8 +285,9 @@ void process_Status()
 	}
 
 	scsiDev.lastStatus = scsiDev.status;
-	scsiDev.lastSense = scsiDev.target->sense.code;
-	scsiDev.lastSenseASC = scsiDev.target->sense.asc;
+	scsiDev.lastSense = scsiDev.target->sense->code;
+	scsiDev.lastSenseASC = scsiDev.target->sense->asc;
+	s2s_traceStatus(scsiDev.status);
 
 	// Command Complete occurs AFTER a valid status has been
 	// sent. then we go bus-free.
@@ -258,8 +345,8 @@ static void process_DataOut()
 		if (parityError &&
 			(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_PARITY))
 		{
-			scsiDev.target->sense.code = ABORTED_COMMAND;
-			scsiDev.target->sense.asc = SCSI_PARITY_ERROR;
+			scsiDev.target->sense->code = ABORTED_COMMAND;
+			scsiDev.target->sense->asc = SCSI_PARITY_ERROR;
 			enter_Status(CHECK_CONDITION);
 		}
 	}
@@ -278,7 +365,7 @@ static void process_DataOut()
 	}
 }
 
-static const uint8_t CmdGroupBytes[8] = {6, 10, 10, 6, 6, 12, 6, 6};
+static const uint8_t CmdGroupBytes[8] = {6, 10, 10, 6, 16, 12, 6, 6};
 static void process_Command()
 {
 	int group;
@@ -329,14 +416,20 @@ static void process_Command()
 			if (scsiDev.targets[tgtIndex].targetId == scsiDev.lun)
 			{
 				scsiDev.target = &scsiDev.targets[tgtIndex];
+				scsiDev.target->sense =
+					&scsiDev.target->initiatorSense[scsiDev.initiatorId];
 				scsiDev.lun = 0;
 				break;
 			}
 		}
 	}
 
+	s2s_traceCommand();
+
 	control = scsiDev.cdb[scsiDev.cdbLen - 1];
 
+	scsiDiskCheckReadAhead();
+
 	scsiDev.cmdCount++;
 	const S2S_TargetCfg* cfg = scsiDev.target->cfg;
 
@@ -350,8 +443,8 @@ static void process_Command()
 	else if (parityError &&
 		(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_PARITY))
 	{
-		scsiDev.target->sense.code = ABORTED_COMMAND;
-		scsiDev.target->sense.asc = SCSI_PARITY_ERROR;
+		scsiDev.target->sense->code = ABORTED_COMMAND;
+		scsiDev.target->sense->asc = SCSI_PARITY_ERROR;
 		enter_Status(CHECK_CONDITION);
 	}
 	else if ((control & 0x02) && ((control & 0x01) == 0) &&
@@ -359,8 +452,8 @@ static void process_Command()
 		likely(scsiDev.target->cfg->quirks != S2S_CFG_QUIRKS_XEBEC))
 	{
 		// FLAG set without LINK flag.
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		enter_Status(CHECK_CONDITION);
 	}
 	else if (command == 0x12)
@@ -376,11 +469,11 @@ static void process_Command()
 		{
 			// Completely non-standard
 			allocLength = 4;
-			if (scsiDev.target->sense.code == NO_SENSE)
+			if (scsiDev.target->sense->code == NO_SENSE)
 				scsiDev.data[0] = 0;
-			else if (scsiDev.target->sense.code == ILLEGAL_REQUEST)
+			else if (scsiDev.target->sense->code == ILLEGAL_REQUEST)
 				scsiDev.data[0] = 0x20; // Illegal command
-			else if (scsiDev.target->sense.code == NOT_READY)
+			else if (scsiDev.target->sense->code == NOT_READY)
 				scsiDev.data[0] = 0x04; // Drive not ready
 			else
 				scsiDev.data[0] = 0x11;  // Uncorrectable data error
@@ -396,8 +489,8 @@ static void process_Command()
 			if (allocLength == 0) allocLength = 4;
 
 			memset(scsiDev.data, 0, 256); // Max possible alloc length
-			scsiDev.data[0] = 0xF0;
-			scsiDev.data[2] = scsiDev.target->sense.code & 0x0F;
+			scsiDev.data[0] = scsiDev.target->sense->deferred ? 0xF1 : 0xF0;
+			scsiDev.data[2] = scsiDev.target->sense->code & 0x0F;
 
 			scsiDev.data[3] = transfer.lba >> 24;
 			scsiDev.data[4] = transfer.lba >> 16;
@@ -406,37 +499,68 @@ static void process_Command()
 
 			// Additional bytes if there are errors to report
 			scsiDev.data[7] = 10; // additional length
-			scsiDev.data[12] = scsiDev.target->sense.asc >> 8;
-			scsiDev.data[13] = scsiDev.target->sense.asc;
+			scsiDev.data[12] = scsiDev.target->sense->asc >> 8;
+			scsiDev.data[13] = scsiDev.target->sense->asc;
+
+			uint16_t progress;
+			if ((scsiDev.target->sense->code == NO_SENSE) &&
+				scsiDiskFormatBusy(&progress))
+			{
+				scsiDev.data[2] = NOT_READY;
+				scsiDev.data[12] = LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS >> 8;
+				scsiDev.data[13] = LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS & 0xFF;
+				scsiDev.data[15] = 0x80; // SKSV, progress indication
+				scsiDev.data[16] = progress >> 8;
+				scsiDev.data[17] = progress;
+			}
 		}
 
 		// Silently truncate results. SCSI-2 spec 8.2.14.
 		enter_DataIn(allocLength);
 
 		// This is a good time to clear out old sense information.
-		scsiDev.target->sense.code = NO_SENSE;
-		scsiDev.target->sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		scsiDev.target->sense->code = NO_SENSE;
+		scsiDev.target->sense->asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		scsiDev.target->sense->deferred = 0;
 	}
 	// Some old SCSI drivers do NOT properly support
 	// unitAttention. eg. the Mac Plus would trigger a SCSI reset
 	// on receiving the unit attention response on boot, thus
 	// triggering another unit attention condition.
-	else if (scsiDev.target->unitAttention &&
+	else if (scsiDev.target->unitAttention[scsiDev.initiatorId] &&
 		(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_UNIT_ATTENTION))
 	{
-		scsiDev.target->sense.code = UNIT_ATTENTION;
-		scsiDev.target->sense.asc = scsiDev.target->unitAttention;
+		scsiDev.target->sense->code = UNIT_ATTENTION;
+		scsiDev.target->sense->asc =
+			scsiDev.target->unitAttention[scsiDev.initiatorId];
 
 		// If initiator doesn't do REQUEST SENSE for the next command, then
 		// data is lost.
-		scsiDev.target->unitAttention = 0;
+		scsiDev.target->unitAttention[scsiDev.initiatorId] = 0;
+
+		enter_Status(CHECK_CONDITION);
+	}
+	else if (scsiDev.target->deferredError[scsiDev.initiatorId])
+	{
+		// Data from an earlier WRITE couldn't be written from the cache.
+		scsiDev.target->sense->code = MEDIUM_ERROR;
+		scsiDev.target->sense->asc =
+			scsiDev.target->deferredError[scsiDev.initiatorId];
+		scsiDev.target->sense->deferred = 1;
+		scsiDev.target->deferredError[scsiDev.initiatorId] = 0;
 
 		enter_Status(CHECK_CONDITION);
 	}
 	else if (scsiDev.lun)
 	{
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = LOGICAL_UNIT_NOT_SUPPORTED;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = LOGICAL_UNIT_NOT_SUPPORTED;
+		enter_Status(CHECK_CONDITION);
+	}
+	else if (scsiDiskFormatBusy(NULL))
+	{
+		scsiDev.target->sense->code = NOT_READY;
+		scsiDev.target->sense->asc = LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS;
 		enter_Status(CHECK_CONDITION);
 	}
 	else if (command == 0x17 || command == 0x16)
@@ -448,21 +572,45 @@ static void process_Command()
 	{
 		enter_Status(CONFLICT);
 	}
-	// Handle odd device types first that may override basic read and
-	// write commands. Will fall-through to generic disk handling.
-	else if (((cfg->deviceType == S2S_CFG_OPTICAL) && scsiCDRomCommand()) ||
-		((cfg->deviceType == S2S_CFG_SEQUENTIAL) && scsiTapeCommand()) ||
-		((cfg->deviceType == S2S_CFG_MO) && scsiMOCommand()))
+	else
 	{
-		// Already handled.
+		// One lookup to find the module that handles this opcode for the
+		// device type.
+		uint8_t op = s2s_getOpcodeTable(cfg->deviceType)[command];
+		int handler = op & S2S_OP_HANDLER_MASK;
+
+		if (unlikely(handler == S2S_OP_UNSUPPORTED))
+		{
+			scsiDev.target->sense->code = ILLEGAL_REQUEST;
+			scsiDev.target->sense->asc = INVALID_COMMAND_OPERATION_CODE;
+			enter_Status(CHECK_CONDITION);
+		}
+		else if (!(op & S2S_OP_ANY_STATE) && unlikely(!scsiDiskTestUnitReady()))
+		{
+			// Status and sense codes already set by scsiDiskTestUnitReady
+		}
+		else if (!OpcodeHandlers[handler]())
+		{
+			scsiDev.target->sense->code = ILLEGAL_REQUEST;
+			scsiDev.target->sense->asc = INVALID_COMMAND_OPERATION_CODE;
+			enter_Status(CHECK_CONDITION);
+		}
 	}
-	else if (scsiDiskCommand())
+
+	// Successful
+	if (scsiDev.phase == COMMAND) // No status set, and not in DATA_IN
 	{
-		// Already handled.
-		// check for the performance-critical read/write
-		// commands ASAP.
+		enter_Status(GOOD);
 	}
-	else if (command == 0x1C)
+
+}
+
+static int doDiagnosticCommand()
+{
+	int commandHandled = 1;
+
+	uint8_t command = scsiDev.cdb[0];
+	if (command == 0x1C)
 	{
 		scsiReceiveDiagnostic();
 	}
@@ -483,19 +631,127 @@ static void process_Command()
 	{
 		scsiReadBuffer();
 	}
-	else if (!scsiModeCommand() && !scsiVendorCommand())
+	else
+	{
+		commandHandled = 0;
+	}
+
+	return commandHandled;
+}
+
+// Returns the only service action supported for opcodes that have one,
+// or -1.
+static int opcodeServiceAction(uint8_t opcode)
+{
+	switch (opcode)
 	{
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_COMMAND_OPERATION_CODE;
+	case 0x9E: return 0x10; // READ CAPACITY(16)
+	case 0xA3: return 0x0C; // REPORT SUPPORTED OPERATION CODES
+	default: return -1;
+	}
+}
+
+static void doReportSupportedOpcodes()
+{
+	const uint8_t* opcodes =
+		s2s_getOpcodeTable(scsiDev.target->cfg->deviceType);
+	int options = scsiDev.cdb[2] & 0x07;
+	uint8_t reqOpcode = scsiDev.cdb[3];
+	int reqServiceAction =
+		(((uint16_t) scsiDev.cdb[4]) << 8) +
+		scsiDev.cdb[5];
+	uint32_t allocLength =
+		(((uint32_t) scsiDev.cdb[6]) << 24) +
+		(((uint32_t) scsiDev.cdb[7]) << 16) +
+		(((uint32_t) scsiDev.cdb[8]) << 8) +
+		scsiDev.cdb[9];
+	uint32_t len = 0;
+
+	if (options == 0)
+	{
+		// All commands. A header, then one 8 byte descriptor each.
+		len = 4;
+		for (int i = 0; i < 256; ++i)
+		{
+			if (!opcodes[i] ||
+				((i == 0x0F) &&
+					(scsiDev.target->cfg->quirks != S2S_CFG_QUIRKS_XEBEC)))
+			{
+				continue;
+			}
+
+			int serviceAction = opcodeServiceAction(i);
+			uint8_t* desc = &scsiDev.data[len];
+			memset(desc, 0, 8);
+			desc[0] = i;
+			if (serviceAction >= 0)
+			{
+				desc[2] = serviceAction >> 8;
+				desc[3] = serviceAction;
+				desc[5] = 0x01; // SERVACTV
+			}
+			desc[7] = CmdGroupBytes[i >> 5];
+			len += 8;
+		}
+		scsiDev.data[0] = (len - 4) >> 24;
+		scsiDev.data[1] = (len - 4) >> 16;
+		scsiDev.data[2] = (len - 4) >> 8;
+		scsiDev.data[3] = len - 4;
+	}
+	else if ((options == 1 || options == 2) &&
+		((opcodeServiceAction(reqOpcode) < 0) == (options == 1)))
+	{
+		// One command, with or without a service action.
+		int supported = opcodes[reqOpcode] &&
+			((options == 1) ||
+				(reqServiceAction == opcodeServiceAction(reqOpcode)));
+		int cdbLen = CmdGroupBytes[reqOpcode >> 5];
+
+		memset(scsiDev.data, 0, 4);
+		scsiDev.data[1] = supported ? 0x03 : 0x01; // SUPPORT
+		len = 4;
+		if (supported)
+		{
+			// CDB usage data. Not every bit is checked, but they may all
+			// be used.
+			scsiDev.data[3] = cdbLen;
+			scsiDev.data[4] = reqOpcode;
+			memset(&scsiDev.data[5], 0xFF, cdbLen - 1);
+			len += cdbLen;
+		}
+	}
+	else
+	{
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		enter_Status(CHECK_CONDITION);
+		return;
 	}
 
-	// Successful
-	if (scsiDev.phase == COMMAND) // No status set, and not in DATA_IN
+	if (len > allocLength)
 	{
-		enter_Status(GOOD);
+		len = allocLength;
 	}
+	enter_DataIn(len);
+}
 
+// Commands handled here after the common checks in process_Command.
+static int doScsiCommand()
+{
+	int commandHandled = 1;
+
+	uint8_t command = scsiDev.cdb[0];
+	if (command == 0xA3 && (scsiDev.cdb[1] & 0x1F) == 0x0C)
+	{
+		// REPORT SUPPORTED OPERATION CODES
+		doReportSupportedOpcodes();
+	}
+	else
+	{
+		commandHandled = 0;
+	}
+
+	return commandHandled;
 }
 
 static void doReserveRelease()
@@ -515,8 +771,8 @@ static void doReserveRelease()
 	if (extentReservation)
 	{
 		// Not supported.
-		scsiDev.target->sense.code = ILLEGAL_REQUEST;
-		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.target->sense->code = ILLEGAL_REQUEST;
+		scsiDev.target->sense->asc = INVALID_FIELD_IN_CDB;
 		enter_Status(CHECK_CONDITION);
 	}
 	else if (command == 0x17) // release
@@ -571,14 +827,20 @@ static void scsiReset()
 
 	if (scsiDev.target)
 	{
-		if (scsiDev.target->unitAttention != POWER_ON_RESET)
+		// A reset clears every initiator's contingent allegiance.
+		for (int i = 0; i < 8; ++i)
 		{
-			scsiDev.target->unitAttention = SCSI_BUS_RESET;
+			if (scsiDev.target->unitAttention[i] != POWER_ON_RESET)
+			{
+				scsiDev.target->unitAttention[i] = SCSI_BUS_RESET;
+			}
+			scsiDev.target->initiatorSense[i].code = NO_SENSE;
+			scsiDev.target->initiatorSense[i].asc =
+				NO_ADDITIONAL_SENSE_INFORMATION;
+			scsiDev.target->initiatorSense[i].deferred = 0;
 		}
 		scsiDev.target->reservedId = -1;
 		scsiDev.target->reserverId = -1;
-		scsiDev.target->sense.code = NO_SENSE;
-		scsiDev.target->sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
 	}
 	scsiDev.target = NULL;
 
@@ -589,11 +851,13 @@ static void scsiReset()
 	}
 	scsiDev.minSyncPeriod = 0;
 
+	// Don't lose data held in the write cache.
+	scsiDiskQuiesce();
 	scsiDiskReset();
 
 	scsiDev.postDataOutHook = NULL;
 
-	scsiDev.sdUnderrunCount = 0;
+	memset(scsiDev.hostSpeed, 0, sizeof(scsiDev.hostSpeed));
 
 	// Sleep to allow the bus to settle down a bit.
 	// We must be ready again within the "Reset to selection time" of
@@ -680,8 +944,22 @@ static void process_SelectionPhase()
 		*SCSI_CTRL_BSY = 1;
 		s2s_ledOn();
 
+		if (scsiDev.selWake)
+		{
+			uint32_t wakeUs =
+				(DWT->CYCCNT - scsiDev.selCycles) / (s2s_cpu_freq / 1000000);
+			if (wakeUs > scsiDev.maxSelWakeUs)
+			{
+				scsiDev.maxSelWakeUs = wakeUs;
+			}
+			scsiDev.selWake = 0;
+		}
+
 		scsiDev.target = target;
 
+		// SCSI1/SASI initiators may not set their own ID.
+		scsiDev.initiatorId = (selStatus >> 3) & 0x7;
+
 		// Do we enter MESSAGE OUT immediately ? SCSI 1 and 2 standards says
 		// move to MESSAGE OUT if ATN is true before we assert BSY.
 		// The initiator should assert ATN with SEL.
@@ -694,7 +972,7 @@ static void process_SelectionPhase()
 		// controllers don't generate parity bits.
 		if (!scsiDev.atnFlag)
 		{
-			target->unitAttention = 0;
+			target->unitAttention[scsiDev.initiatorId] = 0;
 			scsiDev.compatMode = COMPAT_SCSI1;
 		}
 		else if (!(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_SCSI2))
@@ -708,11 +986,10 @@ static void process_SelectionPhase()
 
 		scsiDev.selCount++;
 
-
-		// Save our initiator now that we're no longer in a time-critical
+		// Set up the nexus now that we're no longer in a time-critical
 		// section.
-		// SCSI1/SASI initiators may not set their own ID.
-		scsiDev.initiatorId = (selStatus >> 3) & 0x7;
+		target->sense = &target->initiatorSense[scsiDev.initiatorId];
+		s2s_traceSelection();
 
 		// Wait until the end of the selection phase.
 		uint32_t selTimerBegin = s2s_getTime_ms();
@@ -786,9 +1063,10 @@ static void process_MessageOut()
 	{
 		// BUS DEVICE RESET
 
+		scsiDiskQuiesce();
 		scsiDiskReset();
 
-		scsiDev.target->unitAttention = SCSI_BUS_RESET;
+		scsiSetUnitAttention(scsiDev.target, SCSI_BUS_RESET);
 
 		// ANY initiator can reset the reservation state via this message.
 		scsiDev.target->reservedId = -1;
@@ -865,6 +1143,10 @@ static void process_MessageOut()
 		if (scsiDev.msgOut == 0x23) {
 			// Ignore Wide Residue. We're only 8 bit anyway.
 		} else {
+			// Includes the SIMPLE, HEAD OF QUEUE and ORDERED queue tags.
+			// Rejecting the tag tells the initiator to continue the
+			// command untagged. Queuing needs disconnect support, as only
+			// one command can hold the bus otherwise. See scsiReconnect.
 			messageReject();
 		}
 	}
@@ -952,6 +1234,8 @@ static void process_MessageOut()
 				} else {
 					scsiDev.target->syncPeriod = 50;
 				}
+
+				scsiPhyCalcSyncTiming(scsiDev.target);
 			}
 
 			if (transferPeriod != oldPeriod ||
@@ -964,12 +1248,6 @@ static void process_MessageOut()
 				uint8_t SDTR[] = {0x01, 0x03, 0x01, scsiDev.target->syncPeriod, scsiDev.target->syncOffset};
 				scsiWrite(SDTR, sizeof(SDTR));
 				scsiDev.needSyncNegotiationAck = 1; // Check if this message is rejected.
-				scsiDev.sdUnderrunCount = 0;  // reset counter, may work now.
-
-				// Set to the theoretical speed, then adjust if we measure lower
-				// actual speeds.
-				scsiDev.hostSpeedKBs = s2s_getScsiRateKBs();
-				scsiDev.hostSpeedMeasured = 0;
 			}
 		}
 		else
@@ -1012,7 +1290,11 @@ void scsiPoll(void)
 	switch (scsiDev.phase)
 	{
 	case BUS_FREE:
-		if (scsiStatusBSY())
+		if (unlikely(!busSettled()))
+		{
+			// Signals from the last nexus may still be on the bus.
+		}
+		else if (scsiStatusBSY())
 		{
 			scsiDev.phase = BUS_BUSY;
 		}
@@ -1040,7 +1322,7 @@ void scsiPoll(void)
 	break;
 
 	case ARBITRATION:
-		// TODO Support reselection.
+		// Not supported. See scsiReconnect.
 		break;
 
 	case SELECTION:
@@ -1048,7 +1330,7 @@ void scsiPoll(void)
 	break;
 
 	case RESELECTION:
-		// Not currently supported!
+		// Not supported. See scsiReconnect.
 	break;
 
 	case COMMAND:
@@ -1095,9 +1377,18 @@ void scsiPoll(void)
 		{
 			process_MessageOut();
 		}
+		else if (unlikely(scsiDiskSeekBusy()))
+		{
+			// Emulated access time. Try again later.
+		}
 		else
 		{
 			process_Status();
+			if (likely(scsiDev.phase == MESSAGE_IN) &&
+				likely(scsiDev.msgIn == MSG_COMMAND_COMPLETE))
+			{
+				process_CommandComplete();
+			}
 		}
 	break;
 
@@ -1120,6 +1411,15 @@ void scsiPoll(void)
 	}
 }
 
+// Raise a unit attention condition for every initiator.
+void scsiSetUnitAttention(TargetState* target, uint16_t asc)
+{
+	for (int i = 0; i < 8; ++i)
+	{
+		target->unitAttention[i] = asc;
+	}
+}
+
 void scsiInit()
 {
 	static int firstInit = 1;
@@ -1130,8 +1430,7 @@ void scsiInit()
 	scsiDev.phase = BUS_FREE;
 	scsiDev.target = NULL;
 	scsiDev.compatMode = COMPAT_UNKNOWN;
-	scsiDev.hostSpeedKBs = 0;
-	scsiDev.hostSpeedMeasured = 0;
+	memset(scsiDev.hostSpeed, 0, sizeof(scsiDev.hostSpeed));
 
 	int i;
 	for (i = 0; i < S2S_MAX_TARGETS; ++i)
@@ -1143,6 +1442,10 @@ void scsiInit()
 			scsiDev.targets[i].cfg = cfg;
 
 			scsiDev.targets[i].liveCfg.bytesPerSector = cfg->bytesPerSector;
+			// Write coalescing is done in the write cache.
+			scsiDev.targets[i].liveCfg.writeCache =
+				(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_CACHE) &&
+				scsiDev.boardCfg.writeCoalesce;
 		}
 		else
 		{
@@ -1151,16 +1454,18 @@ void scsiInit()
 		}
 		scsiDev.targets[i].reservedId = -1;
 		scsiDev.targets[i].reserverId = -1;
-		if (firstInit)
-		{
-			scsiDev.targets[i].unitAttention = POWER_ON_RESET;
-		}
-		else
+		scsiSetUnitAttention(
+			&scsiDev.targets[i],
+			firstInit ? POWER_ON_RESET : PARAMETERS_CHANGED);
+		for (int j = 0; j < 8; ++j)
 		{
-			scsiDev.targets[i].unitAttention = PARAMETERS_CHANGED;
+			scsiDev.targets[i].initiatorSense[j].code = NO_SENSE;
+			scsiDev.targets[i].initiatorSense[j].asc =
+				NO_ADDITIONAL_SENSE_INFORMATION;
+			scsiDev.targets[i].initiatorSense[j].deferred = 0;
+			scsiDev.targets[i].deferredError[j] = 0;
 		}
-		scsiDev.targets[i].sense.code = NO_SENSE;
-		scsiDev.targets[i].sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		scsiDev.targets[i].sense = &scsiDev.targets[i].initiatorSense[0];
 
 		scsiDev.targets[i].syncOffset = 0;
 		scsiDev.targets[i].syncPeriod = 0;
@@ -1185,6 +1490,11 @@ void scsiDisconnect()
 }
 */
 
+// Disconnect is left disabled. The FPGA can drive BSY and the data bus for
+// arbitration, but has no SEL output, so we could never reselect the
+// initiator. An initiator left waiting for reselection would time out the
+// command, which is worse than holding the bus while the SD card is busy.
+// Reselection needs FPGA support first.
 /* TODO REENABLE
 int scsiReconnect()
 {
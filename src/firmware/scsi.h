@@ -46,6 +46,7 @@ typedef enum
 {
 	GOOD = 0,
 	CHECK_CONDITION = 2,
+	CONDITION_MET = 4,
 	BUSY = 0x8,
 	INTERMEDIATE = 0x10,
 	CONFLICT = 0x18
@@ -80,6 +81,7 @@ typedef enum
 typedef struct
 {
 	uint16_t bytesPerSector;
+	uint8_t writeCache; // WCE bit of the caching mode page
 } LiveCfg;
 
 typedef struct
@@ -90,9 +92,20 @@ typedef struct
 
 	LiveCfg liveCfg;
 
-	ScsiSense sense;
+	// Sense data for the current I_T nexus. Points into initiatorSense.
+	ScsiSense* sense;
 
-	uint16_t unitAttention; // Set to the sense qualifier key to be returned.
+	// SCSI-2 contingent allegiance: sense data is held for each initiator
+	// until that initiator asks for it. Another initiator's commands must
+	// not clear it.
+	ScsiSense initiatorSense[8];
+
+	// Per initiator. Set to the sense qualifier key to be returned.
+	uint16_t unitAttention[8];
+
+	// Per initiator. Set to the sense qualifier key of a failed background
+	// write, returned as a deferred MEDIUM ERROR.
+	uint16_t deferredError[8];
 
 	// Only let the reserved initiator talk to us.
 	// A 3rd party may be sending the RESERVE/RELEASE commands
@@ -101,8 +114,28 @@ typedef struct
 
 	uint8_t syncOffset;
 	uint8_t syncPeriod;
+
+	// Timing register values for sync DATA IN and DATA OUT phases.
+	// See scsiPhyCalcSyncTiming.
+	uint32_t syncTimingIn;
+	uint32_t syncTimingOut;
 } TargetState;
 
+// Blind write speed estimate for one initiator.
+typedef struct
+{
+	uint32_t speedKBs;
+	uint32_t sampleTime; // s2s_getTime_ms() of the last sample.
+
+	// The sync transfer agreement the estimate was measured with.
+	uint8_t syncPeriod;
+	uint8_t syncOffset;
+
+	uint8_t measured;
+	uint8_t underrunCount;
+	uint32_t underrunTime; // s2s_getTime_ms() of the last underrun.
+} HostSpeed;
+
 typedef struct
 {
 	// TODO reduce this buffer size and add a proper cache
@@ -124,6 +157,16 @@ typedef struct
 
 	// Set to sel register if the SEL flag was set.
 	volatile int selFlag;
+	volatile uint32_t selCycles; // DWT->CYCCNT when selFlag was set.
+
+	// Set when BSY was released without waiting for the bus to settle.
+	// See process_CommandComplete.
+	int busSettling;
+	uint32_t busFreeCycles; // DWT->CYCCNT when BSY was released.
+
+	// Set if mainLoop was woken from sleep by a selection.
+	int selWake;
+	uint32_t maxSelWakeUs; // Longest time from waking to asserting BSY
 
 	// Set to true (1) if a parity error was observed.
 	int parityError;
@@ -134,8 +177,8 @@ typedef struct
 	int savedDataPtr; // Index into data, initially 0.
 	int dataLen;
 
-	uint8_t cdb[12]; // command descriptor block
-	uint8_t cdbLen; // 6, 10, or 12 byte message.
+	uint8_t cdb[16]; // command descriptor block
+	uint8_t cdbLen; // 6, 10, 12 or 16 byte message.
 	int8_t lun; // Target lun, set by IDENTIFY message.
 	uint8_t discPriv; // Disconnect priviledge.
 	uint8_t compatMode; // SCSI_COMPAT_MODE
@@ -164,11 +207,9 @@ typedef struct
 	uint8_t minSyncPeriod; // Debug use only.
 
 	int needSyncNegotiationAck;
-	int sdUnderrunCount;
 
-	// Estimate of the SCSI host actual speed
-	uint32_t hostSpeedKBs;
-	int hostSpeedMeasured;
+	// Estimate of each SCSI host's actual speed, indexed by initiator ID.
+	HostSpeed hostSpeed[8];
 } ScsiDevice;
 
 extern ScsiDevice scsiDev;
@@ -178,6 +219,7 @@ int process_MessageIn(int releaseBusFree);
 void enter_BusFree(void);
 
 void scsiInit(void);
+void scsiSetUnitAttention(TargetState* target, uint16_t asc);
 void scsiPoll(void);
 void scsiDisconnect(void);
 int scsiReconnect(void);
@@ -34,6 +34,7 @@
 #include "time.h"
 #include "fpga.h"
 #include "led.h"
+#include "trace.h"
 
 #include <string.h>
 
@@ -109,10 +110,22 @@ static uint8_t asyncTimings[][4] =
 
 // Private DMA variables.
 static int dmaInProgress = 0;
+static int dmaEnabled = 0;
 
 static DMA_HandleTypeDef memToFSMC;
 static DMA_HandleTypeDef fsmcToMem;
 
+// Background FIFO transfer state. Only one direction is active at a time.
+static ScsiFifoSegment dmaSegs[SCSI_DMA_MAX_SEGMENTS]; // Write only
+static int dmaSegCount;
+static int dmaSeg; // Current segment
+static uint32_t dmaFifoSpace; // Bytes left in the current FIFO chunk
+static uint8_t* dmaData; // Read only
+static uint32_t dmaCount;
+static uint32_t dmaPos; // Within dmaData, or the current segment
+static uint32_t dmaTail; // Bytes left over after the current DMA chunk.
+static int dmaParityError;
+
 
 volatile uint8_t scsiRxDMAComplete;
 volatile uint8_t scsiTxDMAComplete;
@@ -139,6 +152,7 @@ void EXTI4_IRQHandler()
 		if (statusFlags & 0x08) // Check SEL flag
 		{
 			scsiDev.selFlag = *SCSI_STS_SELECTED;
+			scsiDev.selCycles = DWT->CYCCNT;
 		}
 	}
 }
@@ -150,6 +164,8 @@ scsiSetDataCount(uint32_t count)
 	*SCSI_DATA_CNT_MID = (count >> 8) & 0xff;
 	*SCSI_DATA_CNT_LO = count & 0xff;
 	*SCSI_DATA_CNT_SET = 1;
+
+	s2s_traceBytes(count);
 }
 
 int scsiFifoReady(void)
@@ -515,6 +531,48 @@ scsiWritePIO(const uint8_t* data, uint32_t count)
 	}
 }
 
+void
+scsiWriteGatherPIO(const ScsiFifoSegment* segs, int segCount)
+{
+	uint32_t fifoSpace16 = 0;
+
+	for (int s = 0; (s < segCount) && likely(!scsiDev.resetFlag); ++s)
+	{
+		const uint16_t* fifoData = (const uint16_t*)segs[s].data;
+		uint32_t count16 = (segs[s].count + 1) / 2;
+
+		uint32_t i = 0;
+		while ((i < count16) && likely(!scsiDev.resetFlag))
+		{
+			if (fifoSpace16 == 0)
+			{
+				while (!scsiFifoReady() && likely(!scsiDev.resetFlag))
+				{
+					// Spin
+				}
+				fifoSpace16 = SCSI_FIFO_DEPTH16;
+			}
+
+			uint32_t chunk16 = count16 - i;
+			if (chunk16 > fifoSpace16) chunk16 = fifoSpace16;
+
+			uint32_t k = 0;
+			for (; k + 4 <= chunk16; k += 4)
+			{
+				scsiPhyTx32(fifoData[i + k], fifoData[i + k + 1]);
+				scsiPhyTx32(fifoData[i + k + 2], fifoData[i + k + 3]);
+			}
+			for (; k < chunk16; ++k)
+			{
+				scsiPhyTx(fifoData[i + k]);
+			}
+
+			i += chunk16;
+			fifoSpace16 -= chunk16;
+		}
+	}
+}
+
 
 void
 scsiWrite(const uint8_t* data, uint32_t count)
@@ -539,6 +597,207 @@ scsiWrite(const uint8_t* data, uint32_t count)
 	}
 }
 
+int scsiDMAAvailable(void)
+{
+	return dmaEnabled;
+}
+
+// Non-blocking check for the end of a single FIFO chunk.
+static int scsiDMAChunkDone(DMA_HandleTypeDef* hdma)
+{
+	if (!__HAL_DMA_GET_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma)))
+	{
+		if (unlikely(scsiDev.resetFlag))
+		{
+			HAL_DMA_Abort(hdma);
+			dmaInProgress = 0;
+			return 1;
+		}
+		return 0;
+	}
+
+	// Clears the flags and unlocks the handle. Won't wait as the transfer
+	// is already complete.
+	HAL_DMA_PollForTransfer(hdma, HAL_DMA_FULL_TRANSFER, 0);
+	dmaInProgress = 0;
+	return 1;
+}
+
+void
+scsiWriteGatherDMA(const ScsiFifoSegment* segs, int segCount)
+{
+	if (unlikely(!dmaEnabled) || (segCount > SCSI_DMA_MAX_SEGMENTS))
+	{
+		scsiWriteGatherPIO(segs, segCount);
+		scsiTxDMAComplete = 1;
+		return;
+	}
+
+	memcpy(dmaSegs, segs, segCount * sizeof(segs[0]));
+	dmaSegCount = segCount;
+	dmaSeg = 0;
+	dmaPos = 0;
+	dmaFifoSpace = 0;
+	scsiTxDMAComplete = 0;
+
+	scsiWriteDMAPoll();
+}
+
+void
+scsiWriteDMA(const uint8_t* data, uint32_t count)
+{
+	ScsiFifoSegment seg = { data, count };
+	scsiWriteGatherDMA(&seg, 1);
+}
+
+int
+scsiWriteDMAPoll()
+{
+	if (scsiTxDMAComplete)
+	{
+		return 1;
+	}
+
+	if (dmaInProgress && !scsiDMAChunkDone(&memToFSMC))
+	{
+		return 0;
+	}
+
+	while ((dmaSeg < dmaSegCount) && likely(!scsiDev.resetFlag))
+	{
+		const ScsiFifoSegment* seg = &dmaSegs[dmaSeg];
+		if (dmaPos >= seg->count)
+		{
+			++dmaSeg;
+			dmaPos = 0;
+			continue;
+		}
+
+		if (dmaFifoSpace == 0)
+		{
+			if (!scsiFifoReady())
+			{
+				return 0;
+			}
+			dmaFifoSpace = SCSI_FIFO_DEPTH;
+		}
+
+		const uint8_t* data = seg->data + dmaPos;
+		uint32_t chunk = seg->count - dmaPos;
+		if (chunk > dmaFifoSpace) chunk = dmaFifoSpace;
+
+		if (((uint32_t)data & 3) || (chunk < 4))
+		{
+			// The DMA reads whole words. Send a half-word to get aligned,
+			// or the last few bytes of the segment, by PIO.
+			if ((uint32_t)data & 3)
+			{
+				chunk = chunk < 2 ? chunk : 2;
+			}
+			const uint16_t* fifoData = (const uint16_t*)data;
+			for (uint32_t k = 0; k < (chunk + 1) / 2; ++k)
+			{
+				scsiPhyTx(fifoData[k]);
+			}
+		}
+		else
+		{
+			// The source buffer is treated as the peripheral. Count is in
+			// words.
+			chunk &= ~3;
+			HAL_DMA_Start(
+				&memToFSMC,
+				(uint32_t) data,
+				(uint32_t) SCSI_FIFO_DATA,
+				chunk / 4);
+			dmaInProgress = 1;
+		}
+
+		dmaPos += chunk;
+		dmaFifoSpace -= chunk;
+		if (dmaInProgress)
+		{
+			return 0;
+		}
+	}
+
+	scsiTxDMAComplete = 1;
+	return 1;
+}
+
+void
+scsiReadDMA(uint8_t* data, uint32_t count)
+{
+	dmaData = data;
+	dmaCount = count;
+	dmaPos = 0;
+	dmaTail = 0;
+	dmaParityError = 0;
+	scsiRxDMAComplete = 0;
+
+	if (unlikely(!dmaEnabled) || ((uint32_t)data & 3))
+	{
+		scsiReadPIO(data, count, &dmaParityError);
+		dmaPos = count;
+	}
+}
+
+int
+scsiReadDMAPoll(int* parityError)
+{
+	if (scsiRxDMAComplete)
+	{
+		return 1;
+	}
+
+	if (dmaInProgress && !scsiDMAChunkDone(&fsmcToMem))
+	{
+		return 0;
+	}
+
+	if (dmaTail && likely(!scsiDev.resetFlag))
+	{
+		// Remainder of the FIFO chunk that isn't a whole number of words.
+		// No need to wait, it's part of the chunk we already started.
+		uint16_t* fifoData = (uint16_t*)(dmaData + dmaPos);
+		for (uint32_t k = 0; k < (dmaTail + 1) / 2; ++k)
+		{
+			fifoData[k] = scsiPhyRx();
+		}
+		dmaPos += dmaTail;
+		dmaTail = 0;
+	}
+
+	if ((dmaPos >= dmaCount) || unlikely(scsiDev.resetFlag))
+	{
+		*parityError |= dmaParityError | scsiParityError();
+		scsiRxDMAComplete = 1;
+		return 1;
+	}
+
+	// Wait until FIFO is full (or complete)
+	if (!scsiFifoReady())
+	{
+		return 0;
+	}
+
+	uint32_t chunk = dmaCount - dmaPos;
+	if (chunk > SCSI_FIFO_DEPTH) chunk = SCSI_FIFO_DEPTH;
+	dmaTail = chunk & 3;
+	if (chunk >= 4)
+	{
+		// The FSMC is treated as the peripheral. Count is in half-words.
+		HAL_DMA_Start(
+			&fsmcToMem,
+			(uint32_t) SCSI_FIFO_DATA,
+			(uint32_t) (dmaData + dmaPos),
+			(chunk - dmaTail) / 2);
+		dmaInProgress = 1;
+		dmaPos += chunk - dmaTail;
+	}
+	return 0;
+}
+
 static inline void busSettleDelay(void)
 {
 	// Data Release time (switching IO) = 400ns
@@ -551,29 +810,100 @@ void scsiEnterBusFree()
 	*SCSI_CTRL_BSY = 0x00;
 	// We now have a Bus Clear Delay of 800ns to release remaining signals.
 	*SCSI_CTRL_PHASE = 0;
+
+	s2s_traceEnd();
 }
 
+// Timing register values, packed into one word.
+// Byte 0: SCSI_CTRL_DESKEW, 1: SCSI_CTRL_TIMING, 2: SCSI_CTRL_TIMING3
+#define SCSI_TIMING(assertClocks, deskew, hold, glitch) \
+	((((hold) & 7) << 5) | ((deskew) & 0x1F) | \
+		(((assertClocks) & 0x3F) << 8) | \
+		(((glitch) & 0xF) << 16))
+
+// What is programmed into the fpga, including the sync offset in byte 3.
+// Only changed registers are written.
+static uint32_t fpgaTiming;
+static int fpgaTimingValid;
+
+// Async timing for the configured speed. Set by scsiPhyConfig.
+static uint32_t asyncTiming;
+
 static void
-scsiSetTiming(
-	uint8_t assertClocks,
-	uint8_t deskew,
-	uint8_t hold,
-	uint8_t glitch)
-{
-	*SCSI_CTRL_DESKEW = ((hold & 7) << 5) | (deskew & 0x1F);
-	*SCSI_CTRL_TIMING = (assertClocks & 0x3F);
-	*SCSI_CTRL_TIMING3 = (glitch & 0xF);
+scsiSetTiming(uint32_t timing, uint8_t syncOffset)
+{
+	timing |= ((uint32_t) syncOffset) << 24;
+
+	uint32_t changed = fpgaTimingValid ? (timing ^ fpgaTiming) : 0xFFFFFFFF;
+	if (likely(!changed))
+	{
+		return;
+	}
+
+	if (changed & 0xFF)
+	{
+		*SCSI_CTRL_DESKEW = timing;
+	}
+	if (changed & 0xFF00)
+	{
+		*SCSI_CTRL_TIMING = timing >> 8;
+	}
+	if (changed & 0xFF0000)
+	{
+		*SCSI_CTRL_TIMING3 = timing >> 16;
+	}
+	if (changed & 0xFF000000)
+	{
+		*SCSI_CTRL_SYNC_OFFSET = timing >> 24;
+	}
+	fpgaTiming = timing;
+	fpgaTimingValid = 1;
+}
+
+static uint32_t
+scsiAsyncTiming(int index)
+{
+	const uint8_t* timing = asyncTimings[index];
+	return SCSI_TIMING(timing[0], timing[1], timing[2], timing[3]);
 }
 
 static void
 scsiSetDefaultTiming()
 {
-	const uint8_t* asyncTiming = asyncTimings[0];
-	scsiSetTiming(
-		asyncTiming[0],
-		asyncTiming[1],
-		asyncTiming[2],
-		asyncTiming[3]);
+	// After an fpga reset we don't know what's programmed.
+	fpgaTimingValid = 0;
+	scsiSetTiming(scsiAsyncTiming(0), 0);
+}
+
+void scsiPhyCalcSyncTiming(TargetState* target)
+{
+	uint8_t period = target->syncPeriod;
+	if (period < 23)
+	{
+		target->syncTimingIn = target->syncTimingOut =
+			SCSI_TIMING(SCSI_FAST20_ASSERT, SCSI_FAST20_DESKEW, SCSI_FAST20_HOLD, 1);
+	}
+	else if (period <= 25)
+	{
+		target->syncTimingIn =
+			SCSI_TIMING(SCSI_FAST10_WRITE_ASSERT, SCSI_FAST10_DESKEW, SCSI_FAST10_HOLD, 1);
+		target->syncTimingOut =
+			SCSI_TIMING(SCSI_FAST10_READ_ASSERT, SCSI_FAST10_DESKEW, SCSI_FAST10_HOLD, 1);
+	}
+	else
+	{
+		// Amiga A3000 OS3.9 sets period to 35 and fails with
+		// glitch == 1.
+		int glitch =
+			period < 35 ? 1 :
+				(period < 45 ? 2 : 5);
+		int deskew = syncDeskew(period);
+		int hold = syncHold(period);
+		target->syncTimingIn =
+			SCSI_TIMING(syncAssertionWrite(period, deskew), deskew, hold, glitch);
+		target->syncTimingOut =
+			SCSI_TIMING(syncAssertionRead(period), deskew, hold, glitch);
+	}
 }
 
 void scsiEnterPhase(int newPhase)
@@ -596,79 +926,20 @@ uint32_t scsiEnterPhaseImmediate(int newPhase)
 
 	if (newPhase != oldPhase)
 	{
+		s2s_tracePhase(newPhase);
+
 		if ((newPhase == DATA_IN || newPhase == DATA_OUT) &&
 			scsiDev.target->syncOffset)
 		{
-			if (scsiDev.target->syncPeriod < 23)
-			{
-				scsiSetTiming(SCSI_FAST20_ASSERT, SCSI_FAST20_DESKEW, SCSI_FAST20_HOLD, 1);
-			}
-			else if (scsiDev.target->syncPeriod <= 25)
-			{
-				if (newPhase == DATA_IN)
-				{
-					scsiSetTiming(SCSI_FAST10_WRITE_ASSERT, SCSI_FAST10_DESKEW, SCSI_FAST10_HOLD, 1);
-				}
-				else
-				{
-					scsiSetTiming(SCSI_FAST10_READ_ASSERT, SCSI_FAST10_DESKEW, SCSI_FAST10_HOLD, 1);
-				}
-			}
-			else
-			{
-				// Amiga A3000 OS3.9 sets period to 35 and fails with
-				// glitch == 1.
-				int glitch =
-					scsiDev.target->syncPeriod < 35 ? 1 :
-						(scsiDev.target->syncPeriod < 45 ? 2 : 5);
-				int deskew = syncDeskew(scsiDev.target->syncPeriod);
-				int assertion;
-				if (newPhase == DATA_IN)
-				{
-					assertion = syncAssertionWrite(scsiDev.target->syncPeriod, deskew);
-				}
-				else
-				{
-					assertion = syncAssertionRead(scsiDev.target->syncPeriod);
-				}
-				scsiSetTiming(
-					assertion,
-					deskew,
-					syncHold(scsiDev.target->syncPeriod),
-					glitch);
-			}
-
-			*SCSI_CTRL_SYNC_OFFSET = scsiDev.target->syncOffset;
+			scsiSetTiming(
+				newPhase == DATA_IN ?
+					scsiDev.target->syncTimingIn :
+					scsiDev.target->syncTimingOut,
+				scsiDev.target->syncOffset);
 		}
 		else if (newPhase >= 0)
 		{
-
-			*SCSI_CTRL_SYNC_OFFSET = 0;
-			const uint8_t* asyncTiming;
-
-			if (scsiDev.boardCfg.scsiSpeed == S2S_CFG_SPEED_NoLimit)
-			{
-				asyncTiming = asyncTimings[SCSI_ASYNC_SAFE];
-			}
-			else if (scsiDev.boardCfg.scsiSpeed >= S2S_CFG_SPEED_TURBO)
-			{
-				asyncTiming = asyncTimings[SCSI_ASYNC_TURBO];
-			}
-			else if (scsiDev.boardCfg.scsiSpeed >= S2S_CFG_SPEED_ASYNC_50)
-			{
-				asyncTiming = asyncTimings[SCSI_ASYNC_50];
-			} else if (scsiDev.boardCfg.scsiSpeed >= S2S_CFG_SPEED_ASYNC_33) {
-
-				asyncTiming = asyncTimings[SCSI_ASYNC_33];
-
-			} else {
-				asyncTiming = asyncTimings[SCSI_ASYNC_15];
-			}
-			scsiSetTiming(
-				asyncTiming[0],
-				asyncTiming[1],
-				asyncTiming[2],
-				asyncTiming[3]);
+			scsiSetTiming(asyncTiming, 0);
 		}
 
 		uint32_t delayUs = 0;
@@ -730,6 +1001,8 @@ void scsiPhyReset()
 
 		dmaInProgress = 0;
 	}
+	scsiRxDMAComplete = 1;
+	scsiTxDMAComplete = 1;
 
 	s2s_fpgaReset(); // Clears fifos etc.
 
@@ -737,7 +1010,6 @@ void scsiPhyReset()
 	*SCSI_CTRL_BSY = 0x00;
 	*SCSI_CTRL_DBX = 0;
 
-	*SCSI_CTRL_SYNC_OFFSET = 0;
 	scsiSetDefaultTiming();
 
 	// DMA Benchmark code
@@ -857,6 +1129,15 @@ static void scsiPhyInitDMA()
 		HAL_DMA_Init(&fsmcToMem);
 
 		// TODO configure IRQs
+
+		scsiRxDMAComplete = 1;
+		scsiTxDMAComplete = 1;
+
+#ifdef SCSI_FSMC_DMA
+		// Fall back to PIO unless we're on a STM32F446. Other parts may be
+		// affected by the DMA2 FSMC/APB errata.
+		dmaEnabled = (DBGMCU->IDCODE & DBGMCU_IDCODE_DEV_ID) == 0x421;
+#endif
 	}
 }
 
@@ -870,7 +1151,6 @@ void scsiPhyInit()
 	*SCSI_CTRL_BSY = 0x00;
 	*SCSI_CTRL_DBX = 0;
 
-	*SCSI_CTRL_SYNC_OFFSET = 0;
 	scsiSetDefaultTiming();
 
 	*SCSI_CTRL_SEL_TIMING = SCSI_DEFAULT_SELECTION;
@@ -909,6 +1189,25 @@ void scsiPhyConfig()
 	*SCSI_CTRL_SEL_TIMING =
 		(scsiDev.boardCfg.flags & S2S_CFG_ENABLE_SEL_LATCH) ?
 			SCSI_FAST_SELECTION : SCSI_DEFAULT_SELECTION;
+
+	if (scsiDev.boardCfg.scsiSpeed == S2S_CFG_SPEED_NoLimit)
+	{
+		asyncTiming = scsiAsyncTiming(SCSI_ASYNC_SAFE);
+	}
+	else if (scsiDev.boardCfg.scsiSpeed >= S2S_CFG_SPEED_TURBO)
+	{
+		asyncTiming = scsiAsyncTiming(SCSI_ASYNC_TURBO);
+	}
+	else if (scsiDev.boardCfg.scsiSpeed >= S2S_CFG_SPEED_ASYNC_50)
+	{
+		asyncTiming = scsiAsyncTiming(SCSI_ASYNC_50);
+	} else if (scsiDev.boardCfg.scsiSpeed >= S2S_CFG_SPEED_ASYNC_33) {
+
+		asyncTiming = scsiAsyncTiming(SCSI_ASYNC_33);
+
+	} else {
+		asyncTiming = scsiAsyncTiming(SCSI_ASYNC_15);
+	}
 }
 
 
@@ -75,12 +75,21 @@
 
 // Disable DMA due to errate with the STM32F205 DMA2 controller when
 // concurrently transferring FSMC (with FIFO) and APB (ie. sdio)
-// peripherals.
+// peripherals. The STM32F446 isn't affected. The device ID is also checked
+// at runtime, see scsiDMAAvailable().
+#ifdef STM32F4xx
+#define SCSI_FSMC_DMA
+#else
 #undef SCSI_FSMC_DMA
+#endif
 
 void scsiPhyInit(void);
 void scsiPhyConfig(void);
 void scsiPhyReset(void);
+
+// Calculate the sync timing register values for target->syncPeriod.
+// Must be called whenever a non-zero syncOffset is negotiated.
+void scsiPhyCalcSyncTiming(TargetState* target);
 int scsiFifoReady(void);
 
 void scsiEnterPhase(int phase);
@@ -102,15 +111,36 @@ extern volatile uint8_t scsiRxDMAComplete;
 extern volatile uint8_t scsiTxDMAComplete;
 #define scsiDMABusy() (!(scsiRxDMAComplete && scsiTxDMAComplete))
 
-void scsiReadDMA(uint8_t* data, uint32_t count);
-int scsiReadDMAPoll();
+// Non-zero if the FIFO can be accessed via DMA. Otherwise the DMA functions
+// below fall back to PIO and complete before returning.
+int scsiDMAAvailable(void);
 
 // Low-level.
 void scsiReadPIO(uint8_t* data, uint32_t count, int* parityError);
 void scsiWritePIO(const uint8_t* data, uint32_t count);
 
+typedef struct
+{
+	const uint8_t* data;
+	uint32_t count; // Must be even, except for the last segment.
+} ScsiFifoSegment;
+
+// Write the segments back-to-back as a single stream, only waiting for the
+// FIFO after each full FIFO chunk.
+void scsiWriteGatherPIO(const ScsiFifoSegment* segs, int segCount);
+
+// Most segments scsiWriteGatherDMA will send by DMA. Enough for a FIFO's
+// worth of the smallest sectors.
+#define SCSI_DMA_MAX_SEGMENTS (SCSI_FIFO_DEPTH / MIN_SECTOR_SIZE + 1)
+
+// Transfer to/from the FIFO in the background. The caller must have set the
+// data count and keep the buffers untouched until the Poll function
+// returns 1. The segment list itself is copied.
+void scsiWriteGatherDMA(const ScsiFifoSegment* segs, int segCount);
 void scsiWriteDMA(const uint8_t* data, uint32_t count);
-int scsiWriteDMAPoll();
+int scsiWriteDMAPoll(void);
+void scsiReadDMA(uint8_t* data, uint32_t count);
+int scsiReadDMAPoll(int* parityError);
 
 int scsiSelfTest(void);
 
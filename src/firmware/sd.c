@@ -33,6 +33,9 @@
 #include "sd.h"
 #include "led.h"
 #include "time.h"
+#include "cache.h"
+#include "bsp.h"
+#include "trace.h"
 
 #include "scsiPhy.h"
 
@@ -46,41 +49,67 @@ static int sdCmdActive = 0;
 int
 sdReadDMAPoll(uint32_t remainingSectors)
 {
-	// TODO DMA byte counting disabled for now as it's not
-	// working.
-	// We can ask the SDIO controller how many bytes have been
-	// processed (SDIO_GetDataCounter()) but I'm not sure if that
-	// means the data has been transfered via dma to memory yet.
-//	uint32_t dmaBytesRemaining = __HAL_DMA_GET_COUNTER(hsd.hdmarx) * 4;
-
 	if (HAL_SD_GetState(&hsd) != HAL_SD_STATE_BUSY)
 	{
 		// DMA transfer is complete
 		sdCmdActive = 0;
+		s2s_traceSdDone();
 		return remainingSectors;
 	}
-/*	else
+	else if (remainingSectors > 1)
 	{
-		return remainingSectors - ((dmaBytesRemaining + (SD_SECTOR_SIZE - 1)) / SD_SECTOR_SIZE);
-	}*/
+		// The DMA NDTR counter is useless here as the SDIO peripheral is
+		// the flow controller. Instead, the SDIO FIFO counter tells us how
+		// many words the DMA hasn't taken yet. The DMA then holds up to 4
+		// words in its own FIFO before bursting them to memory.
+		uint32_t bytesRemaining = hsd.Instance->FIFOCNT * 4;
+		if ((hsd.hdmarx->Instance->FCR & DMA_SxFCR_FS) != DMA_SxFCR_FS_2)
+		{
+			// DMA FIFO not empty.
+			bytesRemaining += 16;
+		}
+
+		uint32_t sectorsRemaining =
+			(bytesRemaining + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
+
+		// Always wait for the transfer to complete before handing over the
+		// last sector, so we don't miss any errors.
+		if (sectorsRemaining < 1)
+		{
+			sectorsRemaining = 1;
+		}
+
+		if (sectorsRemaining < remainingSectors)
+		{
+			return remainingSectors - sectorsRemaining;
+		}
+	}
 	return 0;
 }
 
-void sdReadDMA(uint32_t lba, uint32_t sectors, uint8_t* outputBuffer)
+int sdStartReadDMA(uint32_t lba, uint32_t sectors, uint8_t* outputBuffer)
 {
 	if (HAL_SD_ReadBlocks_DMA(&hsd, outputBuffer, lba, sectors) != HAL_OK)
+	{
+		return 0;
+	}
+
+	sdCmdActive = 1;
+	s2s_traceSdStart();
+	return 1;
+}
+
+void sdReadDMA(uint32_t lba, uint32_t sectors, uint8_t* outputBuffer)
+{
+	if (!sdStartReadDMA(lba, sectors, outputBuffer))
 	{
 		scsiDiskReset();
 
 		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = HARDWARE_ERROR;
-		scsiDev.target->sense.asc = LOGICAL_UNIT_COMMUNICATION_FAILURE;
+		scsiDev.target->sense->code = HARDWARE_ERROR;
+		scsiDev.target->sense->asc = LOGICAL_UNIT_COMMUNICATION_FAILURE;
 		scsiDev.phase = STATUS;
 	}
-	else
-	{
-		sdCmdActive = 1;
-	}
 }
 
 void sdCompleteTransfer()
@@ -96,6 +125,7 @@ static void sdClear()
 {
 	sdDev.version = 0;
 	sdDev.capacity = 0;
+	sdDev.eraseSectors = 1;
 	memset(sdDev.csd, 0, sizeof(sdDev.csd));
 	memset(sdDev.cid, 0, sizeof(sdDev.cid));
 }
@@ -104,7 +134,11 @@ static int sdDoInit()
 {
 	int result = 0;
 
+	// Any unwritten data in the cache belongs to the previous card.
+	s2s_cacheInvalidateAll();
+	scsiDiskQuiesce();
 	sdClear();
+	s2s_resetSdRate(); // New card, new speed.
 
 	int8_t error = BSP_SD_Init();
 	if (error == MSD_OK)
@@ -114,6 +148,17 @@ static int sdDoInit()
 		memcpy(sdDev.csd, hsd.CSD, sizeof(sdDev.csd));
 		memcpy(sdDev.cid, hsd.CID, sizeof(sdDev.cid));
 		sdDev.capacity = cardInfo.BlockNbr;
+
+		// Cards without ERASE_BLK_EN can only erase whole groups of
+		// SECTOR_SIZE + 1 write blocks.
+		HAL_SD_CardCSDTypeDef csd;
+		if ((HAL_SD_GetCardCSD(&hsd, &csd) == HAL_OK) &&
+			!csd.EraseGrSize &&
+			(csd.MaxWrBlockLen >= 9))
+		{
+			sdDev.eraseSectors =
+				((uint32_t)csd.EraseGrMul + 1) << (csd.MaxWrBlockLen - 9);
+		}
 		blockDev.state |= DISK_PRESENT | DISK_INITIALISED;
 		result = 1;
 
@@ -130,6 +175,33 @@ out:
 	return result;
 }
 
+volatile uint8_t sdCardChanged;
+
+// The card detect switch is also an interrupt, so mainLoop wakes up and
+// checks the card straight away instead of waiting for the next poll.
+static void sdCardDetectInit()
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+	GPIO_InitStruct.Pin = nSD_CD_Pin;
+	GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING_FALLING;
+	GPIO_InitStruct.Pull = GPIO_PULLUP;
+	HAL_GPIO_Init(nSD_CD_GPIO_Port, &GPIO_InitStruct);
+
+	HAL_NVIC_SetPriority(EXTI9_5_IRQn, 10, 0);
+	HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+}
+
+// Note: naming is important to ensure this function is listed in the
+// vector table.
+void EXTI9_5_IRQHandler()
+{
+	if (__HAL_GPIO_EXTI_GET_IT(nSD_CD_Pin) != RESET)
+	{
+		__HAL_GPIO_EXTI_CLEAR_IT(nSD_CD_Pin);
+		sdCardChanged = 1;
+	}
+}
+
 int sdInit()
 {
 	// Check if there's an SD card present.
@@ -141,6 +213,7 @@ int sdInit()
 	{
 		blockDev.state &= ~(DISK_PRESENT | DISK_INITIALISED);
 		sdClear();
+		sdCardDetectInit();
 	}
 
 	if (firstInit || (scsiDev.phase == BUS_FREE))
@@ -203,9 +276,11 @@ int sdInit()
 			int i;
 			for (i = 0; i < S2S_MAX_TARGETS; ++i)
 			{
-				scsiDev.targets[i].unitAttention = PARAMETERS_CHANGED;
+				scsiSetUnitAttention(&scsiDev.targets[i], PARAMETERS_CHANGED);
 			}
 
+			scsiDiskQuiesce();
+			s2s_cacheInvalidateAll();
 			HAL_SD_DeInit(&hsd);
 		}
 	}
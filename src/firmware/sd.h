@@ -25,6 +25,7 @@ typedef struct
 {
 	int version; // SDHC = version 2.
 	uint32_t capacity; // in 512 byte blocks
+	uint32_t eraseSectors; // Erase group size, in 512 byte blocks
 
 	uint8_t csd[16]; // Unparsed CSD
 	uint8_t cid[16]; // Unparsed CID
@@ -34,7 +35,15 @@ extern SdDevice sdDev;
 
 int sdInit(void);
 
+// Set from the card detect interrupt. Cleared by mainLoop before it calls
+// sdInit.
+extern volatile uint8_t sdCardChanged;
+
 void sdReadDMA(uint32_t lba, uint32_t sectors, uint8_t* outputBuffer);
+
+// As per sdReadDMA, but doesn't set any SCSI error status on failure.
+// Returns 1 if the transfer was started.
+int sdStartReadDMA(uint32_t lba, uint32_t sectors, uint8_t* outputBuffer);
 int sdReadDMAPoll(uint32_t remainingSectors);
 void sdCompleteTransfer();
 
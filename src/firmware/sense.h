@@ -155,6 +155,7 @@ typedef enum
 	SPINDLES_NOT_SYNCHRONIZED                              = 0x5C02,
 	SPINDLES_SYNCHRONIZED                                  = 0x5C01,
 	SYNCHRONOUS_DATA_TRANSFER_ERROR                        = 0x1B00,
+	SYSTEM_RESOURCE_FAILURE                                = 0x5500,
 	TARGET_OPERATING_CONDITIONS_HAVE_CHANGED               = 0x3F00,
 	THRESHOLD_CONDITION_MET                                = 0x5B01,
 	THRESHOLD_PARAMETERS_NOT_SUPPORTED                     = 0x2603,
@@ -173,6 +174,7 @@ typedef struct
 {
 	uint8_t code;
 	uint16_t asc;
+	uint8_t deferred; // For an earlier command. Response code 0x71.
 } ScsiSense;
 
 #endif
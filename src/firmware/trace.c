@@ -0,0 +1,271 @@
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef STM32F2xx
+#include "stm32f2xx.h"
+#endif
+#ifdef STM32F4xx
+#include "stm32f4xx.h"
+#endif
+
+#include "trace.h"
+#include "scsi.h"
+#include "time.h"
+
+#include "../../include/scsi2sd.h"
+
+#include <string.h>
+
+S2S_Trace s2s_trace;
+S2S_TargetStats s2s_targetStats[8];
+
+static S2S_TraceRecord ring[S2S_TRACE_RECORDS];
+
+// Number of the next record to be written. Only incremented once the record
+// is complete, so a reader never sees a partial record.
+static volatile uint32_t head;
+
+void s2s_traceSelection()
+{
+	memset(&s2s_trace, 0, sizeof(s2s_trace));
+	s2s_trace.rec.selCycles = DWT->CYCCNT;
+	s2s_trace.selTime = s2s_getTime_ms();
+	s2s_trace.rec.status = 0xFF;
+	s2s_trace.active = 1;
+}
+
+void s2s_traceCommand()
+{
+	s2s_trace.rec.cmdCycles = DWT->CYCCNT;
+	s2s_trace.rec.initiatorId = scsiDev.initiatorId;
+	s2s_trace.rec.targetId = scsiDev.target->targetId;
+	s2s_trace.rec.cdbLen = scsiDev.cdbLen;
+	memcpy(s2s_trace.rec.cdb, scsiDev.cdb, sizeof(s2s_trace.rec.cdb));
+}
+
+void s2s_tracePhase(int phase)
+{
+	if (phase == DATA_IN)
+	{
+		s2s_trace.dataBytes = &s2s_trace.inBytes;
+	}
+	else if (phase == DATA_OUT)
+	{
+		s2s_trace.dataBytes = &s2s_trace.outBytes;
+	}
+	else
+	{
+		s2s_trace.dataBytes = NULL;
+	}
+
+	if (s2s_trace.dataBytes && !s2s_trace.rec.dataCycles)
+	{
+		s2s_trace.rec.dataCycles = DWT->CYCCNT;
+	}
+}
+
+void s2s_traceStatus(uint8_t status)
+{
+	s2s_trace.rec.statusCycles = DWT->CYCCNT;
+	s2s_trace.rec.status = status;
+}
+
+static S2S_STATS_CLASS opcodeClass(uint8_t opcode)
+{
+	switch (opcode)
+	{
+	case 0x08: // READ(6)
+	case 0x28: // READ(10)
+	case 0x88: // READ(16)
+	case 0xA8: // READ(12)
+	case 0x2F: // VERIFY(10)
+	case 0x8F: // VERIFY(16)
+	case 0xAF: // VERIFY(12)
+		return S2S_STATS_READ;
+
+	case 0x0A: // WRITE(6)
+	case 0x2A: // WRITE(10)
+	case 0x2E: // WRITE AND VERIFY(10)
+	case 0x8A: // WRITE(16)
+	case 0x8E: // WRITE AND VERIFY(16)
+	case 0xAA: // WRITE(12)
+	case 0xAE: // WRITE AND VERIFY(12)
+		return S2S_STATS_WRITE;
+
+	case 0x12: // INQUIRY
+	case 0x15: // MODE SELECT(6)
+	case 0x1A: // MODE SENSE(6)
+	case 0x55: // MODE SELECT(10)
+	case 0x5A: // MODE SENSE(10)
+		return S2S_STATS_INFO;
+
+	default:
+		return S2S_STATS_OTHER;
+	}
+}
+
+static void addStats(void)
+{
+	S2S_TargetStats* stats = &s2s_targetStats[s2s_trace.rec.targetId & 7];
+	uint64_t cycles = s2s_trace.rec.endCycles - s2s_trace.rec.selCycles;
+	int bucket;
+
+	// CYCCNT wraps after 2^32 cycles, about 24s at 180MHz. Time anything
+	// close to that, such as a FORMAT UNIT, with the millisecond clock
+	// instead. The ms clock can lag by 1ms, hence the margin.
+	uint32_t ms = s2s_elapsedTime_ms(s2s_trace.selTime);
+	if (ms >= UINT32_MAX / (uint32_t)(s2s_cpu_freq / 1000) - 2)
+	{
+		cycles = (uint64_t)ms * (s2s_cpu_freq / 1000);
+		bucket = S2S_STATS_BUCKETS - 1;
+	}
+	else
+	{
+		uint32_t us = (uint32_t)cycles / (uint32_t)(s2s_cpu_freq / 1000000);
+		bucket = us ? 32 - __builtin_clz(us) : 0;
+		if (bucket >= S2S_STATS_BUCKETS)
+		{
+			bucket = S2S_STATS_BUCKETS - 1;
+		}
+	}
+	stats->latency[opcodeClass(s2s_trace.rec.cdb[0])][bucket]++;
+
+	stats->bytesIn += s2s_trace.inBytes;
+	stats->bytesOut += s2s_trace.outBytes;
+	stats->busyCycles += cycles;
+	stats->sdCycles += s2s_trace.sdBusyCycles;
+}
+
+void s2s_traceEnd()
+{
+	s2s_trace.dataBytes = NULL;
+	if (s2s_trace.active)
+	{
+		s2s_trace.active = 0;
+		s2s_trace.rec.endCycles = DWT->CYCCNT;
+		s2s_trace.rec.bytes = s2s_trace.inBytes + s2s_trace.outBytes;
+
+		// Selected, but no command was received.
+		if (s2s_trace.rec.cmdCycles)
+		{
+			addStats();
+		}
+
+		s2s_trace.rec.seq = head;
+		ring[head & (S2S_TRACE_RECORDS - 1)] = s2s_trace.rec;
+		__DMB();
+		head = head + 1;
+	}
+}
+
+void s2s_traceSdStart()
+{
+	if (s2s_trace.active && !s2s_trace.sdPending)
+	{
+		s2s_trace.sdPending = 1;
+		s2s_trace.sdStartCycles = DWT->CYCCNT;
+	}
+}
+
+void s2s_traceSdDone()
+{
+	if (s2s_trace.active && s2s_trace.sdPending)
+	{
+		uint32_t cycles = DWT->CYCCNT - s2s_trace.sdStartCycles;
+		s2s_trace.sdPending = 0;
+		s2s_trace.sdBusyCycles += cycles;
+		if (!s2s_trace.rec.sdCycles)
+		{
+			s2s_trace.rec.sdCycles = cycles;
+		}
+	}
+}
+
+static uint8_t* put32(uint8_t* out, uint32_t val)
+{
+	out[0] = val >> 24;
+	out[1] = val >> 16;
+	out[2] = val >> 8;
+	out[3] = val;
+	return out + 4;
+}
+
+static uint8_t* put64(uint8_t* out, uint64_t val)
+{
+	out = put32(out, val >> 32);
+	return put32(out, val);
+}
+
+int s2s_statsRead(uint8_t scsiId, uint8_t* out)
+{
+	const S2S_TargetStats* stats = &s2s_targetStats[scsiId & 7];
+
+	uint8_t* p = put32(out, s2s_cpu_freq);
+	p = put64(p, stats->bytesIn);
+	p = put64(p, stats->bytesOut);
+	p = put64(p, stats->busyCycles);
+	p = put64(p, stats->sdCycles);
+	for (int i = 0; i < S2S_STATS_CLASSES; ++i)
+	{
+		for (int j = 0; j < S2S_STATS_BUCKETS; ++j)
+		{
+			p = put32(p, stats->latency[i][j]);
+		}
+	}
+	return p - out;
+}
+
+int s2s_traceRead(uint32_t seq, uint8_t* out, int maxRecords, uint32_t* next)
+{
+	uint32_t end = head;
+	*next = end;
+
+	// Start from the oldest record still held if the host has fallen behind,
+	// or is asking for records from before a reboot.
+	if (end - seq > S2S_TRACE_RECORDS)
+	{
+		seq = end > S2S_TRACE_RECORDS ? end - S2S_TRACE_RECORDS : 0;
+	}
+
+	int count = 0;
+	for (; (seq != end) && (count < maxRecords); ++seq)
+	{
+		S2S_TraceRecord rec = ring[seq & (S2S_TRACE_RECORDS - 1)];
+		__DMB();
+		if (head - seq > S2S_TRACE_RECORDS)
+		{
+			continue; // Overwritten while we were copying it.
+		}
+
+		uint8_t* p = put32(out, rec.seq);
+		*p++ = rec.initiatorId;
+		*p++ = rec.targetId;
+		*p++ = rec.status;
+		*p++ = rec.cdbLen;
+		memcpy(p, rec.cdb, sizeof(rec.cdb));
+		p += sizeof(rec.cdb);
+		p = put32(p, rec.selCycles);
+		p = put32(p, rec.cmdCycles);
+		p = put32(p, rec.dataCycles);
+		p = put32(p, rec.statusCycles);
+		p = put32(p, rec.endCycles);
+		p = put32(p, rec.bytes);
+		put32(p, rec.sdCycles);
+
+		out += S2S_TRACE_RECORD_LEN;
+		++count;
+	}
+	return count;
+}
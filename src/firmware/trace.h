@@ -0,0 +1,116 @@
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef S2S_TRACE_H
+#define S2S_TRACE_H
+
+#include "scsi2sd.h"
+
+#include <stdint.h>
+
+// Trace of recent SCSI commands, for profiling without a logic analyser.
+// One record is kept per command in a ring buffer, and read over USB with
+// S2S_CMD_TRACE. Times are DWT->CYCCNT values.
+// Totals and latency histograms for each target are kept since power on,
+// and read with S2S_CMD_STATS.
+
+// Number of records in the ring buffer. Must be a power of 2.
+#define S2S_TRACE_RECORDS 64
+
+typedef struct
+{
+	uint32_t seq; // Record number
+	uint8_t initiatorId;
+	uint8_t targetId;
+	uint8_t status; // 0xFF if no status was sent
+	uint8_t cdbLen;
+	uint8_t cdb[16];
+	uint32_t selCycles; // Selected
+	uint32_t cmdCycles; // Command received
+	uint32_t dataCycles; // First data phase. 0 if none.
+	uint32_t statusCycles; // Status sent. 0 if none.
+	uint32_t endCycles; // Bus free
+	uint32_t bytes; // Transferred in data phases
+	uint32_t sdCycles; // Latency of the first SD card request. 0 if none.
+} S2S_TraceRecord;
+
+// The command in progress.
+typedef struct
+{
+	S2S_TraceRecord rec;
+	int active;
+	uint32_t selTime; // s2s_getTime_ms() at selection
+	uint32_t* dataBytes; // Counter for the current data phase, or NULL
+	uint32_t inBytes;
+	uint32_t outBytes;
+	int sdPending;
+	uint32_t sdStartCycles;
+	uint32_t sdBusyCycles;
+} S2S_Trace;
+
+extern S2S_Trace s2s_trace;
+
+void s2s_traceSelection(void);
+void s2s_traceCommand(void);
+void s2s_tracePhase(int phase);
+void s2s_traceStatus(uint8_t status);
+void s2s_traceEnd(void);
+
+void s2s_traceSdStart(void);
+void s2s_traceSdDone(void);
+
+// Called for every FPGA transfer count.
+static inline void s2s_traceBytes(uint32_t count)
+{
+	if (s2s_trace.dataBytes)
+	{
+		*s2s_trace.dataBytes += count;
+	}
+}
+
+// Copies up to maxRecords records, starting at record number seq, into out.
+// Each record is S2S_TRACE_RECORD_LEN bytes. Records that have already been
+// overwritten are skipped. Returns the number of records copied, and sets
+// next to the number of the next record to be written.
+int s2s_traceRead(uint32_t seq, uint8_t* out, int maxRecords, uint32_t* next);
+
+// Opcode classes for the latency histograms.
+typedef enum
+{
+	S2S_STATS_READ,
+	S2S_STATS_WRITE,
+	S2S_STATS_INFO, // INQUIRY, MODE SENSE and MODE SELECT
+	S2S_STATS_OTHER,
+	S2S_STATS_CLASSES
+} S2S_STATS_CLASS;
+
+typedef struct
+{
+	// Latency from selection to bus free. See S2S_CMD_STATS.
+	uint32_t latency[S2S_STATS_CLASSES][S2S_STATS_BUCKETS];
+	uint64_t bytesIn; // DATA IN, to the initiator
+	uint64_t bytesOut; // DATA OUT, from the initiator
+	uint64_t busyCycles; // Selection to bus free
+	uint64_t sdCycles; // SD card busy during commands
+} S2S_TargetStats;
+
+// Indexed by SCSI ID.
+extern S2S_TargetStats s2s_targetStats[8];
+
+// Writes the statistics for one SCSI ID in the S2S_CMD_STATS format.
+// Returns the number of bytes written.
+int s2s_statsRead(uint8_t scsiId, uint8_t* out);
+
+#endif
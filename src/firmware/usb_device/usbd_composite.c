@@ -506,6 +506,12 @@ static uint8_t USBD_Composite_DataOut(USBD_HandleTypeDef  *pdev, uint8_t epnum)
 	return USBD_OK;
 }
 
+int s2s_usbDeviceIdle(USBD_HandleTypeDef  *pdev) {
+	USBD_CompositeClassData *classData = (USBD_CompositeClassData*) pdev->pClassData;
+
+	return !classData || (!classData->DataInReady && !classData->DataOutReady);
+}
+
 void s2s_usbDevicePoll(USBD_HandleTypeDef  *pdev) {
 	USBD_CompositeClassData *classData = (USBD_CompositeClassData*) pdev->pClassData;
 
@@ -50,6 +50,10 @@ typedef struct {
 
 void s2s_usbDevicePoll(USBD_HandleTypeDef* pdev);
 
+// Non-zero if s2s_usbDevicePoll has nothing to do. Call with interrupts
+// disabled.
+int s2s_usbDeviceIdle(USBD_HandleTypeDef* pdev);
+
 static inline uint8_t USBD_Composite_IsConfigured(USBD_HandleTypeDef *pdev) {
 	return pdev->dev_state == USBD_STATE_CONFIGURED;
 }
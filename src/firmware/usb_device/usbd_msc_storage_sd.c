@@ -28,6 +28,7 @@
 
 #include "../bsp_driver_sd.h"
 #include "../bsp.h"
+#include "../cache.h"
 #include "../disk.h"
 #include "../led.h"
 #include "../sd.h"
@@ -147,6 +148,8 @@ int8_t s2s_usbd_storage_Read (uint8_t lun,
 	s2s_ledOn();
 	const S2S_TargetCfg* cfg = getUsbConfig(lun);
 
+	scsiDiskQuiesce();
+
 	if (cfg->bytesPerSector == 512)
 	{
 		BSP_SD_ReadBlocks_DMA(
@@ -193,6 +196,11 @@ int8_t s2s_usbd_storage_Write (uint8_t lun,
 	s2s_ledOn();
 	const S2S_TargetCfg* cfg = getUsbConfig(lun);
 
+	scsiDiskQuiesce();
+	s2s_cacheInvalidate(
+		SCSISector2SD(cfg->sdSectorStart, cfg->bytesPerSector, blk_addr),
+		blk_len * SDSectorsPerSCSISector(cfg->bytesPerSector));
+
 	if (cfg->bytesPerSector == 512)
 	{
 		BSP_SD_WriteBlocks_DMA(
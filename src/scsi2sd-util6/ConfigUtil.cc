@@ -393,6 +393,14 @@ ConfigUtil::toXML(const S2S_BoardCfg& config)
 			(config.flags6 & S2S_CFG_ENABLE_BLIND_WRITES ? "true" : "false") <<
 			"</blindWrites>\n" <<
 
+		"	<!-- ********************************************************\n" <<
+		"	Hold up to this many 512-byte sectors of sequential writes in\n" <<
+		"	the write cache, and write them to the SD card together.\n" <<
+		"	Requires enableCache. Enables the write cache by default, the\n" <<
+		"	host can turn it off with MODE SELECT. 0 = disabled. Max 16.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<writeCoalesce>" << static_cast<int>(config.writeCoalesce) << "</writeCoalesce>\n" <<
+
 		"</S2S_BoardCfg>\n";
 
 	return s.str();
@@ -652,6 +660,10 @@ parseBoardConfig(wxXmlNode* node)
 		{
 			result.scsiSpeed = parseInt(child, S2S_CFG_SPEED_SYNC_10);
 		}
+		else if (child->GetName() == "writeCoalesce")
+		{
+			result.writeCoalesce = parseInt(child, 16);
+		}
 		child = child->GetNext();
 	}
 	return result;
@@ -143,6 +143,35 @@ HID::readSCSIDebugInfo(std::vector<uint8_t>& buf)
 	return buf.size() > 0;
 }
 
+void
+HID::readSCSITrace(uint32_t seq, std::vector<uint8_t>& buf)
+{
+	std::vector<uint8_t> cmd
+	{
+		S2S_CMD_TRACE,
+		static_cast<uint8_t>(seq >> 24),
+		static_cast<uint8_t>(seq >> 16),
+		static_cast<uint8_t>(seq >> 8),
+		static_cast<uint8_t>(seq)
+	};
+	sendHIDPacket(cmd, buf, HIDPACKET_MAX_LEN / 62);
+	if (buf.size() < 9)
+	{
+		throw std::runtime_error("SCSI2SD trace protocol error");
+	}
+}
+
+void
+HID::readSCSIStats(uint8_t scsiId, std::vector<uint8_t>& buf)
+{
+	std::vector<uint8_t> cmd { S2S_CMD_STATS, scsiId };
+	sendHIDPacket(cmd, buf, HIDPACKET_MAX_LEN / 62);
+	if (buf.size() < S2S_STATS_LEN)
+	{
+		throw std::runtime_error("SCSI2SD stats protocol error");
+	}
+}
+
 
 void
 HID::readHID(uint8_t* buffer, size_t len)
@@ -68,6 +68,14 @@ public:
 
 	bool readSCSIDebugInfo(std::vector<uint8_t>& buf);
 
+	// Reads trace records starting at record number seq.
+	// See S2S_CMD_TRACE for the response format.
+	void readSCSITrace(uint32_t seq, std::vector<uint8_t>& buf);
+
+	// Reads the statistics for one SCSI ID.
+	// See S2S_CMD_STATS for the response format.
+	void readSCSIStats(uint8_t scsiId, std::vector<uint8_t>& buf);
+
 	std::string getSerialNumber();
 	std::string getHardwareVersion();
 	bool isCorrectFirmware(const std::string& path);
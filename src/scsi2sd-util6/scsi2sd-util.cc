@@ -195,6 +195,11 @@ public:
 			_("SCSI Standalone Self-Test"),
 			_("SCSI Standalone Self-Test"));
 
+		menuDebug->Append(
+			ID_Stats,
+			_("Performance &Statistics"),
+			_("Report command latency and SD card load for each SCSI ID"));
+
 		wxMenu *menuHelp = new wxMenu();
 		menuHelp->Append(wxID_ABOUT);
 
@@ -360,7 +365,8 @@ private:
 		ID_SelfTest,
 		ID_SaveFile,
 		ID_OpenFile,
-		ID_ConsoleTerm
+		ID_ConsoleTerm,
+		ID_Stats
 	};
 
 	void OnID_ConfigDefaults(wxCommandEvent& event)
@@ -463,6 +469,119 @@ private:
 		myLogWindow->Show();
 	}
 
+	static uint64_t getStat(const std::vector<uint8_t>& buf, size_t pos, int len)
+	{
+		uint64_t val = 0;
+		for (int i = 0; i < len; ++i)
+		{
+			val = (val << 8) | buf[pos + i];
+		}
+		return val;
+	}
+
+	// Upper bound of the histogram bucket holding the given fraction of
+	// commands.
+	static std::string latencyPercentile(
+		const std::vector<uint32_t>& hist, uint64_t count, double fraction)
+	{
+		uint64_t total = 0;
+		for (size_t i = 0; i < hist.size(); ++i)
+		{
+			total += hist[i];
+			if (total >= count * fraction)
+			{
+				std::stringstream ss;
+				if (i == hist.size() - 1)
+				{
+					ss << ">= " << (1u << (i - 1)) << "us";
+				}
+				else
+				{
+					ss << "< " << (1u << i) << "us";
+				}
+				return ss.str();
+			}
+		}
+		return "-";
+	}
+
+	void logStats(int scsiId, const std::vector<uint8_t>& buf)
+	{
+		static const char* classes[] =
+			{ "Read", "Write", "Inquiry/Mode", "Other" };
+
+		double cpuHz = getStat(buf, 0, 4);
+		uint64_t bytesIn = getStat(buf, 4, 8);
+		uint64_t bytesOut = getStat(buf, 12, 8);
+		double busySecs = getStat(buf, 20, 8) / cpuHz;
+		double sdSecs = getStat(buf, 28, 8) / cpuHz;
+
+		std::stringstream ss;
+		uint64_t totalCommands = 0;
+		for (int c = 0; c < 4; ++c)
+		{
+			std::vector<uint32_t> hist;
+			uint64_t count = 0;
+			for (int b = 0; b < S2S_STATS_BUCKETS; ++b)
+			{
+				hist.push_back(getStat(buf, 36 + (c * S2S_STATS_BUCKETS + b) * 4, 4));
+				count += hist.back();
+			}
+			if (count > 0)
+			{
+				ss << "  " << classes[c] << ": " << count << " commands, " <<
+					"median " << latencyPercentile(hist, count, 0.5) <<
+					", 99th percentile " << latencyPercentile(hist, count, 0.99) <<
+					std::endl;
+			}
+			totalCommands += count;
+		}
+		if (totalCommands == 0)
+		{
+			return;
+		}
+
+		std::stringstream msg;
+		msg << std::fixed << std::setprecision(1) <<
+			"SCSI ID " << scsiId << ": " << totalCommands << " commands" <<
+			std::endl <<
+			"  Data in: " << (bytesIn / 1048576.0) << "MiB, " <<
+			"data out: " << (bytesOut / 1048576.0) << "MiB" << std::endl <<
+			"  Busy for " << busySecs << "s, SD card busy for " << sdSecs <<
+			"s";
+		if (busySecs > 0)
+		{
+			// Time not spent waiting for the card is spent on the bus.
+			int sdPercent = static_cast<int>(100 * sdSecs / busySecs);
+			msg << " (" << sdPercent << "%, " <<
+				(sdPercent >= 50 ? "card-bound" : "bus-bound") << ")";
+		}
+		msg << std::endl << ss.str();
+		wxLogMessage(this, "%s", msg.str());
+	}
+
+	void OnID_Stats(wxCommandEvent& event)
+	{
+		TimerLock lock(myTimer);
+		if (!myHID) return;
+
+		myLogWindow->Show();
+		try
+		{
+			for (int i = 0; i < 8; ++i)
+			{
+				std::vector<uint8_t> buf;
+				myHID->readSCSIStats(i, buf);
+				logStats(i, buf);
+			}
+		}
+		catch (std::exception& e)
+		{
+			wxLogWarning(this, e.what());
+			myHID.reset();
+		}
+	}
+
 	void doFirmwareUpdate()
 	{
 		wxFileDialog dlg(
@@ -749,7 +868,7 @@ private:
         {
 		std::stringstream msg;
 		msg << std::hex;
-		for (size_t i = 0; i < 32 && i < buf.size(); ++i)
+		for (size_t i = 0; i < 42 && i < buf.size(); ++i)
 		{
 			msg << std::setfill('0') << std::setw(2) <<
 			static_cast<int>(buf[i]) << ' ';
@@ -1086,6 +1205,7 @@ wxBEGIN_EVENT_TABLE(AppFrame, wxFrame)
 	EVT_MENU(AppFrame::ID_ConfigDefaults, AppFrame::OnID_ConfigDefaults)
 	EVT_MENU(AppFrame::ID_Firmware, AppFrame::OnID_Firmware)
 	EVT_MENU(AppFrame::ID_LogWindow, AppFrame::OnID_LogWindow)
+	EVT_MENU(AppFrame::ID_Stats, AppFrame::OnID_Stats)
 	EVT_MENU(AppFrame::ID_SaveFile, AppFrame::OnID_SaveFile)
 	EVT_MENU(AppFrame::ID_OpenFile, AppFrame::OnID_OpenFile)
 	EVT_MENU(wxID_EXIT, AppFrame::OnExitEvt)